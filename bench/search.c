@@ -0,0 +1,88 @@
+/*
+  Throughput of the threaded literal search. Counts the occurrences of
+  QUERY in FILE with 1, 2, 4 and so on up to THREADS threads, and
+  prints the best of three runs for each.
+
+  Usage: bin/bench-search FILE QUERY [THREADS]
+*/
+#define main ted_main
+#include "../src/ted.c"
+#undef main
+
+#include <time.h>
+
+#define RUNS (3)
+
+static double now()
+{
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+
+        return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void run(size_t threads)
+{
+        double best = 0;
+        size_t n = 0, before;
+
+        ed.nthreads = threads;
+        for (size_t i = 0; i < RUNS; ++i) {
+                double t = now();
+                if (!count_literal(&n, &before)) {
+                        fprintf(stderr, "Count was stopped by input.\n");
+                        exit(1);
+                }
+                t = now() - t;
+                if (!i || t < best)
+                        best = t;
+        }
+
+        printf("%8zu %10.3f %10.0f %12zu\n", threads, best, text_size() / best / 1e6, n);
+}
+
+int main(int argc, char *argv[])
+{
+        int fds[2];
+        long max = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (argc < 3 || argc > 4 || !argv[2][0] || strlen(argv[2]) >= QUERY_MAX) {
+                fprintf(stderr, "Usage: %s FILE QUERY [THREADS]\n", argv[0]);
+                return 1;
+        }
+        if (argc == 4)
+                max = strtol(argv[3], NULL, 10);
+        if (max < MIN_THREADS || max > MAX_THREADS) {
+                fprintf(stderr, "THREADS should be from %d to %d.\n", MIN_THREADS, MAX_THREADS);
+                return 1;
+        }
+
+        /*
+          The count stops as soon as input is waiting, so read from a pipe
+          that never has any.
+        */
+        if (pipe(fds) || dup2(fds[0], STDIN_FILENO) < 0) {
+                perror("pipe");
+                return 1;
+        }
+
+        ed.nlines = DEFAULT_NLINES;
+        ed.ncols = DEFAULT_NCOLS;
+        ed.tabstop = DEFAULT_TABSTOP;
+        ed.filetype = DEFAULT_FILETYPE;
+        loadf(argv[1]);
+        if (!finish_loading())
+                err_exit(loading.error);
+
+        ed.search.kind = SEARCH_LITERAL;
+        ed.search.len = strlen(argv[2]);
+        memcpy(ed.search.query, argv[2], ed.search.len + 1);
+
+        printf("%8s %10s %10s %12s\n", "threads", "seconds", "MB/s", "matches");
+        for (long j = 1; j < max; j *= 2)
+                run(j);
+        run(max);
+
+        return 0;
+}
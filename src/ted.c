@@ -1,4 +1,4 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <ctype.h>
@@ -6,8 +6,11 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -16,6 +19,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -33,26 +37,41 @@
 
 #define DEFAULT_FILETYPE (UNIX)
 
+#define MIN_THREADS (1)
+#define MAX_THREADS (256)
+
 #define DEFAULT_INDENT ((uint8_t *)"\t")
 
 #define MARK_RING_SIZE (16)
 #define TEMP_MARKS_SIZE (16)
 
 #define SEARCH_SIZE (100)
+#define QUERY_MAX (256)
+#define SEARCH_CHUNK (1024 * 1024)
+#define MATCHES_MAX (MAX_NLINES * MAX_NCOLS)
+#define FUZZY_LINE_MAX (4096)
+#define RE_STATES_MAX (1024)
 
 #define CMD_MAX (256)
 
-#define CONTINUATION_LINE_STR "\x1b[31m\\\x1b[m"
-#define EMPTY_LINE_STR "\x1b[34m~\x1b[m"
+#define INPUT_SIZE (4096)
+
+#define CONTINUATION_LINE_STR "\x1b[31m"
+#define EMPTY_LINE_STR "\x1b[34m"
+#define MATCH_STR "\x1b[30;43m"
 
 #define INFO_PRE ("\x1b[33m")
 #define ERROR_PRE ("\x1b[31m\x1b[1m")
 
 #define BUFSIZE (1024 * 1024)
 
+#define MIN_BUFSIZE (1024)
+
+#define CHECKPOINT_INTERVAL (4096)
+
 #define BLKSIZE (4096)
 
-#define SCREENBUF_SIZE (MAX_NLINES * (MAX_NCOLS + 1) * 4)
+#define OUTPUT_SIZE (MAX_NLINES * (MAX_NCOLS + 1) * 16)
 
 #define guard(cond)             \
         do {                    \
@@ -67,6 +86,14 @@ enum {
         UTF8 = 1,
 };
 
+enum {
+        PLAIN,
+        REGION,
+        MATCH,
+        CONTINUATION_LINE,
+        EMPTY_LINE,
+};
+
 struct utf8 {
         uint8_t c[4];
 };
@@ -152,6 +179,37 @@ void tedchar_from_utf8(struct tedchar *t, uint8_t *src)
         utf8_char_copy(t->u.c, src);
 }
 
+/*
+  The buffer stores text as UTF-8 with a single '\n' for every newline.
+  Decode the character starting at p.
+*/
+struct tedchar tedchar_at(uint8_t *p)
+{
+        struct tedchar t = {0};
+
+        if (*p == '\n')
+                return tedchar_newline();
+
+        tedchar_from_utf8(&t, p);
+        return t;
+}
+
+size_t tedchar_to_bytes(uint8_t *dest, struct tedchar t)
+{
+        if (is_newline(t)) {
+                dest[0] = '\n';
+                return 1;
+        }
+
+        utf8_char_copy(dest, t.u.c);
+        return utf8_count(t.u.c);
+}
+
+bool is_continuation_byte(uint8_t b)
+{
+        return (b & 0xc0) == 0x80;
+}
+
 bool utf8_eq(struct utf8 u1, struct utf8 u2)
 {
         size_t n1 = utf8_count(u1.c);
@@ -433,14 +491,183 @@ struct key scan_escape(uint8_t buf[])
 #pragma GCC diagnostic pop
 }
 
+/*
+  Everything meant for the terminal, frame and echo area alike, is
+  gathered here and sent with a single write when the editor is about
+  to wait for input, so that a frame never shows half drawn. On
+  terminals that know synchronized output, each write is bracketed by
+  CSI ? 2026 h and l, and the terminal shows it only once it has all
+  of it, even if it arrives in pieces.
+*/
+struct {
+        uint8_t *b;
+        size_t last;
+        size_t capacity;
+        bool is_synced;
+} output;
+
+#define SYNC_BEGIN "\x1b[?2026h"
+#define SYNC_END "\x1b[?2026l"
+
+void writev_all(struct iovec *iov, int cnt)
+{
+        while (cnt > 0) {
+                ssize_t w = writev(STDOUT_FILENO, iov, cnt);
+                if (w < 0 && errno == EINTR)
+                        continue;
+                if (w <= 0)
+                        return;
+                for (; cnt > 0 && (size_t)w >= iov->iov_len; --cnt, ++iov)
+                        w -= iov->iov_len;
+                if (cnt > 0) {
+                        iov->iov_base = (uint8_t *)iov->iov_base + w;
+                        iov->iov_len -= w;
+                }
+        }
+}
+
+void write_out(const void *p, size_t n)
+{
+        struct iovec iov[3] = {
+                {SYNC_BEGIN, strlen(SYNC_BEGIN)},
+                {(void *)p, n},
+                {SYNC_END, strlen(SYNC_END)},
+        };
+
+        if (!n)
+                return;
+
+        if (output.is_synced)
+                writev_all(iov, 3);
+        else
+                writev_all(iov + 1, 1);
+}
+
+void output_flush()
+{
+        write_out(output.b, output.last);
+        output.last = 0;
+}
+
+void output_append(const void *p, size_t n)
+{
+        if (output.last + n > output.capacity) {
+                size_t capacity = output.capacity ? output.capacity : OUTPUT_SIZE;
+                while (capacity < output.last + n)
+                        capacity *= 2;
+
+                uint8_t *b = realloc(output.b, capacity);
+                if (b) {
+                        output.b = b;
+                        output.capacity = capacity;
+                } else {
+                        output_flush();
+                        if (n > output.capacity) {
+                                write_out(p, n);
+                                return;
+                        }
+                }
+        }
+
+        memcpy(output.b + output.last, p, n);
+        output.last += n;
+}
+
+struct {
+        struct key k;
+        bool is_set;
+} unread;
+
+/* Make k the next key returned by read_key. */
+void unread_key(struct key k)
+{
+        unread.k = k;
+        unread.is_set = true;
+}
+
+/*
+  Bytes read from the terminal that are not yet returned as keys. One
+  read can return many keys when text is pasted or typed ahead, and
+  read_key takes them one at a time.
+*/
+struct {
+        uint8_t b[INPUT_SIZE];
+        size_t start;
+        size_t end;
+} input;
+
+/* Whether a key is waiting to be read. */
+bool key_pending()
+{
+        struct pollfd p = {.fd = STDIN_FILENO, .events = POLLIN};
+
+        output_flush();
+
+        return unread.is_set || input.start < input.end || poll(&p, 1, 0) > 0;
+}
+
+/*
+  The length of the key at the start of the n bytes at s, or 0 if the
+  rest of it is still to come. An escape or CSI introducer that ends the
+  bytes read so far is the whole key, since that is how the escape key
+  and M-[ arrive.
+*/
+static size_t key_length(const uint8_t *s, size_t n)
+{
+        size_t i = 1;
+
+        if (s[0] >= 0x80) {
+                while (i < utf8_count(s) && i < n && is_continuation_byte(s[i]))
+                        ++i;
+                return i == n && i < utf8_count(s) ? 0 : i;
+        }
+
+        if (s[0] != 0x1b || n == 1)
+                return 1;
+
+        if (s[1] != '[')
+                return s[1] <= 0x19 || (0x20 <= s[1] && s[1] <= 0x7f) ? 2 : 1;
+
+        if (n == 2)
+                return 2;
+
+        i = 2;
+        while (i < n && (isdigit(s[i]) || s[i] == ';'))
+                ++i;
+
+        return i < n ? i + 1 : 0;
+}
+
 struct key read_key()
 {
         struct key k = {0};
         uint8_t buf[16] = {0};
+        size_t n;
+
+        if (unread.is_set) {
+                unread.is_set = false;
+                return unread.k;
+        }
+
+        output_flush();
+
+        while (input.start == input.end ||
+               !(n = key_length(input.b + input.start, input.end - input.start))) {
+                memmove(input.b, input.b + input.start, input.end - input.start);
+                input.end -= input.start;
+                input.start = 0;
+                if (input.end == INPUT_SIZE) {
+                        n = 1;
+                        break;
+                }
+
+                ssize_t nread = read(STDIN_FILENO, input.b + input.end, INPUT_SIZE - input.end);
+                assert(nread > 0); // TODO: Exit gracefully.
+                input.end += nread;
+        }
 
-        ssize_t nread = read(STDIN_FILENO, buf, sizeof(buf));
-        assert(nread > 0); // TODO: Exit gracefully.
-        buf[min(nread, 15)] = 0;
+        memcpy(buf, input.b + input.start, min(n, sizeof(buf) - 1));
+        input.start += n;
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic"
@@ -671,7 +898,7 @@ void emit_csi(char c, int n, int m)
         else
                 snprintf(buf, 32, "\x1b[%c", c);
 
-        write(STDOUT_FILENO, buf, strlen(buf));
+        output_append(buf, strlen(buf));
 }
 
 void emit_private(char c, int n)
@@ -680,7 +907,7 @@ void emit_private(char c, int n)
 
         snprintf(buf, 32, "\x1b[?%d%c", n, c);
 
-        write(STDOUT_FILENO, buf, strlen(buf));
+        output_append(buf, strlen(buf));
 }
 
 void hide_cursor()
@@ -704,17 +931,17 @@ void goto_(struct position pos)
 
 void emit_cr()
 {
-        printf("\r");
+        output_append("\r", 1);
 }
 
 void emit_el()
 {
-        printf("\x1b[K");
+        output_append("\x1b[K", 3);
 }
 
 void emit_lf()
 {
-        printf("\n");
+        output_append("\n", 1);
 }
 
 void emit_cuu(int n)
@@ -741,6 +968,7 @@ struct termios old_termios;
 
 void terminal_reset()
 {
+        output_flush();
         tcsetattr(STDIN_FILENO, TCSADRAIN, &old_termios);
 }
 
@@ -760,26 +988,51 @@ void terminal_setup()
         atexit(terminal_reset);
 }
 
+struct match {
+        size_t start;
+        size_t end;
+};
+
+/*
+  The matches of the search that show on screen, merged into intervals
+  of offsets. They are found once per frame from the top of the
+  viewport to the most text it can hold, so drawing them costs as much
+  as the viewport and not the buffer. Regex matches that start above
+  the viewport are not found, and those that run past it are cut short
+  where it ends.
+*/
 struct {
-        uint8_t b[SCREENBUF_SIZE];
-        size_t last;
-} screenbuf;
+        struct match m[MATCHES_MAX];
+        size_t len;
+} frame_matches;
 
-void screenbuf_init()
-{
-        screenbuf.last = 0;
-}
+/*
+  The screen region is drawn as a grid of cells, one per column, each a
+  character and its style. The grid on screen is kept, so that a new
+  frame only sends the rows that changed, from their first changed
+  cell. Frames are built in cells[cur] and compared with the other.
+*/
+struct cell {
+        uint8_t style;
+        struct utf8 u;
+};
+
+struct {
+        struct cell cells[2][MAX_NLINES][MAX_NCOLS + 1];
+        size_t len[2][MAX_NLINES];
+        size_t cur;
+        size_t row;
+        bool is_valid;
+} frame;
 
 void just_cstring(const char *s)
 {
-        while (*s)
-                screenbuf.b[screenbuf.last++] = *(s++);
+        output_append(s, strlen(s));
 }
 
 void just_utf8(struct utf8 u)
 {
-        utf8_char_copy(screenbuf.b + screenbuf.last, u.c);
-        screenbuf.last += utf8_count(u.c);
+        output_append(u.c, utf8_count(u.c));
 }
 
 void highlight_on()
@@ -792,40 +1045,86 @@ void highlight_off()
         just_cstring("\x1b[m");
 }
 
-void csi(char c, int n, int m)
+void match_on()
 {
-        char buf[32];
+        just_cstring(MATCH_STR);
+}
 
-        if (n >= 0 && m >= 0)
-                snprintf(buf, 32, "\x1b[%4d;%4d%c", n, m, c);
-        else if (n >= 0)
-                snprintf(buf, 32, "\x1b[%4d%c", n, c);
-        else if (m >= 0)
-                snprintf(buf, 32, "\x1b[;%4d%c", m, c);
-        else
-                snprintf(buf, 32, "\x1b[%c", c);
+void el()
+{
+        emit_csi('K', -1, -1);
+}
+
+/*
+  Find an answer from the terminal in the input read so far: prefix,
+  then digits and ';', then final. Returns its offset in input.b with
+  its length in n, or SIZE_MAX.
+*/
+static size_t find_answer(const char *prefix, const char *final, size_t *n)
+{
+        size_t lp = strlen(prefix);
+        size_t lf = strlen(final);
+
+        for (size_t i = input.start; i + lp <= input.end; ++i) {
+                if (memcmp(input.b + i, prefix, lp))
+                        continue;
+
+                size_t j = i + lp;
+                while (j < input.end && (isdigit(input.b[j]) || input.b[j] == ';'))
+                        ++j;
+
+                if (j + lf <= input.end && !memcmp(input.b + j, final, lf)) {
+                        *n = j + lf - i;
+                        return i;
+                }
+        }
 
-        just_cstring(buf);
+        return SIZE_MAX;
 }
 
-void el()
+/* Take the n bytes at offset i out of the input. */
+static void drop_input(size_t i, size_t n)
 {
-        csi('K', -1, -1);
+        memmove(input.b + i, input.b + i + n, input.end - i - n);
+        input.end -= n;
 }
 
+/*
+  Read answers up to the cursor position report. The answer to a mode
+  query sent just before may come ahead of it; terminals that do not
+  know the query send nothing. Keys typed meanwhile stay in the input
+  for read_key.
+*/
 struct position cpr()
 {
-        struct position p;
-        char buf[32];
+        struct position p = {0};
+        char report[32] = {0};
+        size_t i, n;
 
         emit_csi('n', 6, -1);
+        output_flush();
+
+        while ((i = find_answer("\x1b[", "R", &n)) == SIZE_MAX) {
+                memmove(input.b, input.b + input.start, input.end - input.start);
+                input.end -= input.start;
+                input.start = 0;
+                if (input.end == INPUT_SIZE)
+                        drop_input(0, INPUT_SIZE / 2);
+
+                ssize_t nread = read(STDIN_FILENO, input.b + input.end, INPUT_SIZE - input.end);
+                assert(nread > 0);
+                input.end += nread;
+        }
 
-        size_t n = read(STDIN_FILENO, buf, sizeof(buf));
-        assert(n > 0);
-        buf[n] = 0;
+        memcpy(report, input.b + i, min(n, sizeof(report) - 1));
+        output_append(input.b + i, n);
+        drop_input(i, n);
+        sscanf(report, "\x1b[%zu;%zuR", &p.y, &p.x);
 
-        printf("%s", buf);
-        sscanf(buf, "\x1b[%zu;%zuR", &p.y, &p.x);
+        if ((i = find_answer("\x1b[?2026;", "$y", &n)) != SIZE_MAX) {
+                output.is_synced = input.b[i + 8] == '1' || input.b[i + 8] == '2';
+                drop_input(i, n);
+        }
 
         return p;
 }
@@ -840,15 +1139,10 @@ void restore_cursor()
         emit_csi('u', -1, -1);
 }
 
-void cr()
-{
-        just_cstring("\r");
-}
-
-void lf()
-{
-        just_cstring("\n");
-}
+struct checkpoint {
+        size_t off;
+        size_t index;
+};
 
 struct {
         size_t nlines;
@@ -869,6 +1163,7 @@ struct {
         int prefix_arg;
 
         size_t tabstop;
+        size_t nthreads;
         enum { UNIX, DOS } filetype;
         bool ensure_trailing_newline;
         char *filename;
@@ -876,10 +1171,31 @@ struct {
         char *basename;
         mode_t filemode;
         struct timespec mtime;
-        struct tedchar buffer[BUFSIZE];
-        struct tedchar *gap_start;
-        struct tedchar *gap_end;
-        struct tedchar *tl;
+        uint8_t *buffer;
+        size_t capacity;
+        uint8_t *gap_start;
+        uint8_t *gap_end;
+        size_t nchars;
+        size_t point_index;
+        struct {
+                struct checkpoint *c;
+                size_t before;
+                size_t after;
+                size_t capacity;
+        } checkpoints;
+        struct {
+                size_t *nl;
+                size_t before;
+                size_t after;
+                size_t capacity;
+        } lines;
+        struct {
+                size_t *r;
+                size_t len;
+                size_t capacity;
+                bool complete;
+        } rows;
+        uint8_t *tl;
         size_t cursor_row;
         size_t cursor_col;
         size_t goal_col;
@@ -897,7 +1213,14 @@ struct {
                 size_t len;
         } temp_marks;
         struct {
-                size_t results[SEARCH_SIZE];
+                enum { SEARCH_NONE, SEARCH_LITERAL, SEARCH_REGEX, SEARCH_LIST } kind;
+                uint8_t query[QUERY_MAX];
+                size_t len;
+                struct regex *re;
+                size_t start;
+                size_t end;
+                size_t *results;
+                size_t capacity;
                 size_t last;
                 size_t current;
         } search;
@@ -905,20 +1228,11 @@ struct {
         bool is_dirty;
         struct key last_key;
         bool preserve_echo;
-        struct tedchar kill_buffer[BUFSIZE];
+        uint8_t *kill_buffer;
         size_t kill_size;
+        size_t kill_capacity;
 } ed;
 
-void screenbuf_draw()
-{
-        save_cursor();
-
-        goto_(ed.screen_begin);
-        write(STDOUT_FILENO, screenbuf.b, screenbuf.last);
-
-        restore_cursor();
-}
-
 /*
   Only UTF8_ASCII allowed in echo messages.
 */
@@ -946,7 +1260,7 @@ void echo_clear()
         save_cursor();
 
         goto_(ed.echo_begin);
-        write(STDOUT_FILENO, "\x1b[K", strlen("\x1b[K"));
+        emit_el();
 
         restore_cursor();
 }
@@ -965,7 +1279,7 @@ void echo_error(const char *message, ...)
         save_cursor();
 
         goto_(ed.echo_begin);
-        write(STDOUT_FILENO, buf, strlen(buf));
+        output_append(buf, strlen(buf));
 
         restore_cursor();
 
@@ -986,7 +1300,7 @@ void echo_info(const char *message, ...)
         save_cursor();
 
         goto_(ed.echo_begin);
-        write(STDOUT_FILENO, buf, strlen(buf));
+        output_append(buf, strlen(buf));
 
         restore_cursor();
 }
@@ -1001,6 +1315,7 @@ void emit_clear_screen()
 {
         goto_(ed.screen_begin);
         emit_csi('J', -1, -1);
+        frame.is_valid = false;
 }
 
 void reserve_screen()
@@ -1015,7 +1330,10 @@ void reserve_screen()
 
         emit_cuu(ed.nlines);
 
+        output.is_synced = false;
+        just_cstring("\x1b[?2026$p");
         ed.screen_begin = cpr();
+        frame.is_valid = false;
 
         emit_cud(ed.nlines);
         ed.echo_begin = cpr();
@@ -1023,1743 +1341,5252 @@ void reserve_screen()
         goto_(ed.screen_begin);
 }
 
-void move_point(struct tedchar *p)
+size_t text_size()
 {
-        assert(p);
+        return ed.capacity - (ed.gap_end - ed.gap_start);
+}
 
-        if (p == ed.gap_end)
-                return;
+/*
+  Buffer offsets count bytes of text and ignore the gap.
+*/
+uint8_t *pointer_at(size_t off)
+{
+        size_t before = ed.gap_start - ed.buffer;
 
-        if (p < ed.gap_start) {
-                ptrdiff_t n = ed.gap_start - p;
-                struct tedchar *d = ed.gap_end;
-                memmove(d - n, p, n * sizeof(struct tedchar));
-                ed.gap_start = p;
-                ed.gap_end = d - n;
-        } else if (p > ed.gap_end) {
-                struct tedchar *d = ed.gap_start;
-                struct tedchar *s = ed.gap_end;
-                memmove(d, s, (p - s) * sizeof(struct tedchar));
-                ed.gap_start += p - s;
-                ed.gap_end += p - s;
-        }
+        if (off < before)
+                return ed.buffer + off;
+
+        return ed.gap_end + (off - before);
 }
 
-size_t tedchar_from_bytes(struct tedchar dest[], size_t n, const uint8_t src[], size_t m)
+size_t offset_of(uint8_t *p)
 {
-        size_t i = 0;
-        size_t j = 0;
+        if (p < ed.gap_start)
+                return p - ed.buffer;
 
-        while (j < m) {
-                if (ed.filetype == DOS && src[j] == '\r') {
-                        if (j + 1 < m && src[j + 1] == '\n') {
-                                dest[i++] = tedchar_newline();
-                                j += 2;
-                        } else {
-                                err_exit("<cr> not followed by <lf> in file.\n");
-                        }
-                } else if (ed.filetype == UNIX && src[j] == '\n') {
-                        dest[i++] = tedchar_newline();
-                        ++j;
-                } else {
-                        size_t k = utf8_count(&src[j]);
-                        if (j + k - 1 >= m) {
-                                err_exit("Invalid utf8 in file.\n");
-                        }
+        return (ed.gap_start - ed.buffer) + (p - ed.gap_end);
+}
 
-                        if (k == 1)
-                                if (src[j] != '\t' && (src[j] < 0x20 || src[j] > 0x7e))
-                                        err_exit("Invalid ASCII in file.\n");
-                        assert(i < n);
-                        for (size_t x = 0; x < k; ++x)
-                                dest[i].u.c[x] = src[j++];
-                        dest[i].kind = UTF8;
-                        ++i;
-                }
-        }
+/*
+  The text between two offsets is at most two contiguous spans, one on
+  each side of the gap. Loops that go over a lot of text take them one
+  at a time and run over plain arrays:
 
-        return i;
-}
+        struct spans it = spans(from, to);
+        uint8_t *p;
+        size_t n;
 
-void disable_mark()
+        while (next_span(&it, &p, &n))
+                ...
+*/
+struct spans {
+        size_t from;
+        size_t to;
+};
+
+struct spans spans(size_t from, size_t to)
 {
-        ed.marks.is_active = false;
+        return (struct spans){.from = from, .to = to};
 }
 
-void loadf(const char *filename)
+bool next_span(struct spans *it, uint8_t **p, size_t *n)
 {
-        int fd;
+        size_t before = ed.gap_start - ed.buffer;
 
-        char *rp = realpath(filename, NULL);
-        if (!rp) {
-                rp = strdup(filename);
-        }
-        if (!rp) {
-                perror("loadf: strdup() failed");
-                return;
-        }
+        if (it->from >= it->to)
+                return false;
 
-        char *d1 = strdup(rp);
-        char *b1 = strdup(rp);
-        if (!d1 || !b1) {
-                free(d1);
-                free(b1);
-                perror("loadf: strdup() failed");
-                return;
-        }
+        *p = pointer_at(it->from);
+        *n = (it->from < before ? min(before, it->to) : it->to) - it->from;
+        it->from += *n;
 
-        char *d = strdup(dirname(d1));
-        char *b = strdup(basename(b1));
-        if (!d || !b) {
-                free(d);
-                free(b);
-                perror("loadf: strdup() failed");
+        return true;
+}
+
+/*
+  Step *p over one character, moving on to the next span once the one
+  ending at *end is used up. *p becomes NULL at the end.
+*/
+void span_step(struct spans *it, uint8_t **p, uint8_t **end)
+{
+        size_t n;
+
+        *p += utf8_count(*p);
+        if (*p < *end)
                 return;
-        }
 
-        free(d1);
-        free(b1);
+        if (next_span(it, p, &n))
+                *end = *p + n;
+        else
+                *p = NULL;
+}
 
-        struct stat st;
+static size_t count_span(const uint8_t *p, size_t n)
+{
+        size_t c = 0;
 
-        if (stat(d, &st)) {
-                perror("loadf: stat() failed");
-                goto err3;
-        }
+        for (size_t i = 0; i < n; ++i)
+                c += !is_continuation_byte(p[i]);
 
-        if (!S_ISDIR(st.st_mode)) {
-                fprintf(stderr, "loadf: '%s': not a directory.\n", d);
-                goto err3;
-        }
+        return c;
+}
 
-        if (access(d, R_OK) != 0) {
-                fprintf(stderr, "loadf: Cannot read directory '%s'.\n", d);
-                goto err3;
-        }
+/*
+  Number of characters between offsets from and to.
+*/
+size_t count_chars(size_t from, size_t to)
+{
+        struct spans it = spans(from, to);
+        uint8_t *p;
+        size_t n;
+        size_t c = 0;
 
-        if ((fd = open(filename, O_RDONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-                perror("loadf: Failed to open file");
-                goto err3;
-        }
+        while (next_span(&it, &p, &n))
+                c += count_span(p, n);
 
-        if (fstat(fd, &st) < 0) {
-                perror("loadf: fstat() failed");
-                goto err2;
-        }
+        return c;
+}
 
-        ssize_t n = 0;
+/*
+  Offset of the character n characters after the one at offset off.
+*/
+size_t skip_chars(size_t off, size_t n)
+{
+        size_t before = ed.gap_start - ed.buffer;
+        size_t size = text_size();
 
-        uint8_t *buf = malloc(st.st_size);
-        if (!buf) {
-                perror("loadf: malloc() failed");
-                goto err2;
-        }
+        for (; n && off < before; --n)
+                off += utf8_count(ed.buffer + off);
 
-        while (n < st.st_size) {
-                ssize_t r = read(fd, buf + n, st.st_size - n);
+        for (; n && off < size; --n)
+                off += utf8_count(ed.gap_end + (off - before));
 
-                if (r < 0) {
-                        perror("loadf: read() failed");
-                        goto err1;
-                }
+        return off;
+}
 
-                if (r == 0)
-                        break;
+void copy_text(uint8_t *dest, size_t from, size_t to)
+{
+        struct spans it = spans(from, to);
+        uint8_t *p;
+        size_t n;
 
-                n += r;
+        while (next_span(&it, &p, &n)) {
+                memcpy(dest, p, n);
+                dest += n;
         }
+}
 
-        close(fd);
-
-        n = tedchar_from_bytes(ed.buffer, BUFSIZE, buf, st.st_size);
-
-        free(buf);
-
-        ed.filename = rp;
-        ed.dirname = d;
-        ed.basename = b;
-        ed.filemode = st.st_mode;
-        ed.mtime = st.st_mtim;
-
-        ed.ensure_trailing_newline = true;
+/*
+  ed.lines holds the offset of every newline, split at the gap like the
+  text. The first before entries count from the start of the text. The
+  last after entries count back from the end of the text, so that
+  neither side changes when text is inserted or deleted at point.
+*/
+bool grow_lines(size_t n)
+{
+        size_t capacity = ed.lines.capacity;
 
-        ed.gap_start = ed.buffer + n;
-        ed.gap_end = ed.buffer + BUFSIZE;
-        ed.cursor_row = 0;
-        ed.cursor_col = 0;
-        ed.goal_col = 0;
-        ed.tl = NULL;
+        while (ed.lines.before + ed.lines.after + n > capacity)
+                capacity *= 2;
 
-        ed.marks.len = 0;
-        ed.marks.first = 0;
-        ed.marks.last = 0;
-        ed.marks.current = 0;
-        ed.marks.is_active = false;
+        if (capacity == ed.lines.capacity)
+                return true;
 
-        ed.search.last = 0;
-        ed.search.current = 0;
+        size_t *nl = realloc(ed.lines.nl, capacity * sizeof(size_t));
+        if (!nl)
+                return false;
 
-        ed.is_read_only = false;
-        ed.is_dirty = false;
+        memmove(nl + capacity - ed.lines.after, nl + ed.lines.capacity - ed.lines.after,
+                ed.lines.after * sizeof(size_t));
+        ed.lines.nl = nl;
+        ed.lines.capacity = capacity;
 
-        ed.preserve_echo = false;
+        return true;
+}
 
-        ed.kill_size = 0;
+/*
+  Move entries across the split after the gap moved to offset off.
+*/
+void lines_move_gap(size_t off)
+{
+        size_t size = text_size();
+        size_t *nl = ed.lines.nl;
+        size_t end = ed.lines.capacity;
 
-        if (n) {
-                move_point(ed.buffer);
-                ed.tl = ed.gap_end;
+        while (ed.lines.after && size - nl[end - ed.lines.after] < off) {
+                nl[ed.lines.before++] = size - nl[end - ed.lines.after];
+                --ed.lines.after;
         }
 
-        return;
-
-err1:
-        free(buf);
-err2:
-        close(fd);
-err3:
-        exit(1);
+        while (ed.lines.before && nl[ed.lines.before - 1] >= off) {
+                ++ed.lines.after;
+                nl[end - ed.lines.after] = size - nl[--ed.lines.before];
+        }
 }
 
-struct tedchar *advance(struct tedchar *p)
+/*
+  Offset of the first character of line n, counting from 1. Lines past
+  the last one start at the end of the text.
+*/
+size_t line_offset(size_t n)
 {
-        if (p >= ed.gap_end) {
-                if (p + 1 < ed.buffer + BUFSIZE)
-                        return p + 1;
-                else
-                        return NULL;
-        }
+        if (n <= 1)
+                return 0;
 
-        if (p + 1 < ed.gap_start)
-                return p + 1;
+        size_t j = n - 2;
 
-        if (ed.gap_end < ed.buffer + BUFSIZE)
-                return ed.gap_end;
+        if (j < ed.lines.before)
+                return ed.lines.nl[j] + 1;
 
-        return NULL;
+        j -= ed.lines.before;
+        if (j < ed.lines.after)
+                return text_size() - ed.lines.nl[ed.lines.capacity - ed.lines.after + j] + 1;
+
+        return text_size();
 }
 
-struct tedchar *retreat(struct tedchar *p)
+size_t line_number()
 {
-        if (p == ed.buffer)
-                return NULL;
+        return ed.lines.before + 1;
+}
 
-        if (p == ed.gap_end) {
-                if (ed.gap_start == ed.buffer)
-                        return NULL;
-                else
-                        return ed.gap_start - 1;
+/*
+  Offset of the first character of the line containing offset off.
+*/
+size_t line_start_of(size_t off)
+{
+        size_t size = text_size();
+        size_t *after = ed.lines.nl + ed.lines.capacity - ed.lines.after;
+        size_t lo, hi;
+
+        if (ed.lines.after && size - after[0] < off) {
+                lo = 0;
+                hi = ed.lines.after;
+                while (hi - lo > 1) {
+                        size_t mid = lo + (hi - lo) / 2;
+                        if (size - after[mid] < off)
+                                lo = mid;
+                        else
+                                hi = mid;
+                }
+                return size - after[lo] + 1;
         }
 
-        return p - 1;
+        if (!ed.lines.before || ed.lines.nl[0] >= off)
+                return 0;
+
+        lo = 0;
+        hi = ed.lines.before;
+        while (hi - lo > 1) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (ed.lines.nl[mid] < off)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+        return ed.lines.nl[lo] + 1;
 }
 
-size_t next_col(struct tedchar t, size_t col)
+/*
+  Offset in the text of byte off of the file as saved. DOS files have a
+  <cr> before every newline, so their file offsets run ahead by one per
+  line, and a <cr> maps to the newline after it. An offset inside a
+  multibyte character maps to the start of that character.
+*/
+size_t offset_of_file_offset(size_t off)
 {
-        assert(col < ed.ncols);
+        size_t lo = 1, hi = ed.lines.before + ed.lines.after + 1;
+        size_t size = text_size();
 
-        if (is_newline(t)) {
-                return 0;
-        } else if (is_tab(t)) {
-                size_t new_col = col + ed.tabstop - col % ed.tabstop;
-                if (new_col >= ed.ncols)
-                        return 0;
-                return new_col;
+        if (ed.filetype == UNIX) {
+                off = min(off, size);
         } else {
-                if (col + 1 >= ed.ncols)
-                        return 0;
-                return col + 1;
+                while (lo < hi) {
+                        size_t mid = lo + (hi - lo + 1) / 2;
+                        if (line_offset(mid) + (mid - 1) <= off)
+                                lo = mid;
+                        else
+                                hi = mid - 1;
+                }
+
+                if (lo == ed.lines.before + ed.lines.after + 1)
+                        off = min(off - (lo - 1), size);
+                else
+                        off = min(off - (lo - 1), line_offset(lo + 1) - 1);
         }
-}
 
-bool is_point_at_beginning_of_buffer()
-{
-        return ed.gap_start == ed.buffer;
-}
+        while (off && off < size && is_continuation_byte(*pointer_at(off)))
+                --off;
 
-bool is_point_at_end_of_buffer()
-{
-        return ed.gap_end == ed.buffer + BUFSIZE;
+        return off;
 }
 
-bool is_buffer_empty()
+/*
+  ed.checkpoints pairs byte offsets with the indices of the characters
+  there, about every CHECKPOINT_INTERVAL bytes, so that either can be
+  found from the other by counting from the nearest pair. Like ed.lines,
+  the table is split at the gap: the first before pairs lie before point
+  and count from the start of the text, and the last after pairs count
+  back from the end of the text and of the characters, so that inserting
+  or deleting at point changes neither side.
+*/
+bool grow_checkpoints(size_t n)
 {
-        return (ed.gap_end - ed.gap_start) == BUFSIZE;
-}
+        size_t capacity = ed.checkpoints.capacity;
 
-size_t buffer_size()
-{
-        return (ed.gap_start - ed.buffer) + (ed.buffer + BUFSIZE - ed.gap_end);
-}
+        while (ed.checkpoints.before + ed.checkpoints.after + n > capacity)
+                capacity *= 2;
 
-struct tedchar *first_char()
-{
-        if (is_buffer_empty())
-                return NULL;
+        if (capacity == ed.checkpoints.capacity)
+                return true;
 
-        if (ed.gap_start > ed.buffer)
-                return ed.buffer;
+        struct checkpoint *c = realloc(ed.checkpoints.c, capacity * sizeof(*c));
+        if (!c)
+                return false;
 
-        return ed.gap_end;
+        memmove(c + capacity - ed.checkpoints.after,
+                c + ed.checkpoints.capacity - ed.checkpoints.after,
+                ed.checkpoints.after * sizeof(*c));
+        ed.checkpoints.c = c;
+        ed.checkpoints.capacity = capacity;
+
+        return true;
 }
 
-struct tedchar *char_at_point()
+/* Turn a pair that counts from one end of the text into one that counts from the other. */
+static struct checkpoint flip_checkpoint(struct checkpoint c)
 {
-        if (is_buffer_empty() || is_point_at_end_of_buffer())
-                return NULL;
-
-        return ed.gap_end;
+        return (struct checkpoint){.off = text_size() - c.off, .index = ed.nchars - c.index};
 }
 
-#define current_char() (assert(!is_point_at_end_of_buffer()), *char_at_point())
-
-struct tedchar *char_at_index(size_t i)
+/*
+  Move pairs across the split after the gap moved to offset off.
+*/
+void checkpoints_move_gap(size_t off)
 {
-        if (i >= buffer_size())
-                return NULL;
-
-        size_t n = ed.gap_start - ed.buffer;
+        struct checkpoint *c = ed.checkpoints.c;
+        size_t end = ed.checkpoints.capacity;
 
-        if (i < n)
-                return &ed.buffer[i];
-        else
-                return &ed.gap_end[i - n];
-}
+        while (ed.checkpoints.after && text_size() - c[end - ed.checkpoints.after].off < off) {
+                c[ed.checkpoints.before++] = flip_checkpoint(c[end - ed.checkpoints.after]);
+                --ed.checkpoints.after;
+        }
 
-size_t index_of(struct tedchar *t)
-{
-        if (t < ed.gap_start)
-                return t - ed.buffer;
-        else
-                return (ed.gap_start - ed.buffer) + (t - ed.gap_end);
+        while (ed.checkpoints.before && c[ed.checkpoints.before - 1].off >= off) {
+                ++ed.checkpoints.after;
+                c[end - ed.checkpoints.after] = flip_checkpoint(c[--ed.checkpoints.before]);
+        }
 }
 
-size_t where()
+/*
+  Add pairs to the before side over the text from offset off, which is
+  the start of character i, to offset to. The pairs only save counting,
+  so none are added if memory runs out.
+*/
+static void add_checkpoints(size_t off, size_t i, size_t to)
 {
-        if (is_point_at_end_of_buffer())
-                return buffer_size();
-        return index_of(char_at_point());
-}
+        if (!grow_checkpoints((to - off) / CHECKPOINT_INTERVAL))
+                return;
 
-static size_t new_temp_mark()
-{
-        ed.temp_marks.m[ed.temp_marks.len++] = where();
-        return ed.temp_marks.len - 1;
-}
+        while (to - off > CHECKPOINT_INTERVAL) {
+                size_t next = off + CHECKPOINT_INTERVAL;
 
-static size_t position_of_temp_mark(size_t temp_mark)
-{
-        return ed.temp_marks.m[temp_mark];
-}
+                while (next < to && is_continuation_byte(*pointer_at(next)))
+                        ++next;
+                if (next == to)
+                        break;
 
-static void free_temp_mark(size_t temp_mark)
-{
-        assert(ed.temp_marks.len - 1 == temp_mark);
-        --ed.temp_marks.len;
+                i += count_chars(off, next);
+                off = next;
+                ed.checkpoints.c[ed.checkpoints.before++] =
+                        (struct checkpoint){.off = off, .index = i};
+        }
 }
 
-static void update_marks_after_insert(size_t point)
+/*
+  Add checkpoints over text just inserted before point. They start from
+  the last checkpoint before it rather than from the insertion, so text
+  typed a character at a time gets them as well.
+*/
+static void checkpoint_insertion()
 {
-        size_t *marks = ed.marks.m;
+        struct checkpoint last = {0};
 
-        for (size_t i = 0; i < ed.marks.len; ++i) {
-                size_t j = (ed.marks.first + i) % MARK_RING_SIZE;
-                if (marks[j] >= point)
-                        ++marks[j];
-        }
+        if (ed.checkpoints.before)
+                last = ed.checkpoints.c[ed.checkpoints.before - 1];
 
-        for (size_t i = 0; i < ed.temp_marks.len; ++i)
-                if (ed.temp_marks.m[i] >= point)
-                        ++ed.temp_marks.m[i];
+        add_checkpoints(last.off, last.index, ed.gap_start - ed.buffer);
 }
 
-static void update_marks_after_delete(size_t point)
-{
-        size_t *marks = ed.marks.m;
+/*
+  The last pair that is at or before both offset off and character i,
+  counting point as one.
+*/
+static struct checkpoint nearest_checkpoint(size_t off, size_t i)
+{
+        struct checkpoint *c = ed.checkpoints.c;
+        struct checkpoint *after = c + ed.checkpoints.capacity - ed.checkpoints.after;
+        struct checkpoint point = {.off = ed.gap_start - ed.buffer, .index = ed.point_index};
+        struct checkpoint best = {0};
+        size_t lo, hi;
+
+        if (point.off <= off && point.index <= i) {
+                best = point;
+                lo = 0;
+                hi = ed.checkpoints.after;
+                while (lo < hi) {
+                        size_t mid = lo + (hi - lo) / 2;
+                        struct checkpoint x = flip_checkpoint(after[mid]);
+                        if (x.off <= off && x.index <= i) {
+                                best = x;
+                                lo = mid + 1;
+                        } else {
+                                hi = mid;
+                        }
+                }
+                return best;
+        }
 
-        for (size_t i = 0; i < ed.marks.len; ++i) {
-                size_t j = (ed.marks.first + i) % MARK_RING_SIZE;
-                if (marks[j] > point)
-                        --marks[j];
+        lo = 0;
+        hi = ed.checkpoints.before;
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (c[mid].off <= off && c[mid].index <= i) {
+                        best = c[mid];
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
         }
 
-        for (size_t i = 0; i < ed.temp_marks.len; ++i)
-                if (ed.temp_marks.m[i] > point)
-                        --ed.temp_marks.m[i];
+        return best;
 }
 
-size_t col_of(struct tedchar *p)
+void move_point(uint8_t *p)
 {
         assert(p);
 
-        struct tedchar *q = retreat(p);
-
-        if (!q)
-                return 0;
+        if (p == ed.gap_end)
+                return;
 
-        struct tedchar *qq = q;
-        while (qq && !is_newline(*qq)) {
-                q = qq;
-                qq = retreat(qq);
-        }
+        size_t n;
+        size_t tl = ed.tl ? offset_of(ed.tl) : 0;
 
-        size_t col = 0;
-        while (q != p) {
-                col = next_col(*q, col);
-                q = advance(q);
+        if (p < ed.gap_start) {
+                n = ed.gap_start - p;
+                uint8_t *d = ed.gap_end;
+                ed.point_index -= count_span(p, n);
+                memmove(d - n, p, n);
+                ed.gap_start = p;
+                ed.gap_end = d - n;
+        } else if (p > ed.gap_end) {
+                uint8_t *d = ed.gap_start;
+                uint8_t *s = ed.gap_end;
+                n = p - s;
+                ed.point_index += count_span(s, n);
+                memmove(d, s, n);
+                ed.gap_start += n;
+                ed.gap_end += n;
+        } else {
+                return;
         }
 
-        return col;
+        lines_move_gap(ed.gap_start - ed.buffer);
+        checkpoints_move_gap(ed.gap_start - ed.buffer);
+        if (ed.tl)
+                ed.tl = pointer_at(tl);
 }
 
-struct tedchar *first_of_visual_line(struct tedchar *p)
+/*
+  Reallocate the buffer to hold capacity bytes. The gap absorbs the
+  difference; text before and after the gap, and ed.tl, are preserved.
+*/
+bool resize_buffer(size_t capacity)
 {
-        assert(p);
+        size_t before = ed.gap_start - ed.buffer;
+        size_t after = ed.buffer + ed.capacity - ed.gap_end;
+        ptrdiff_t tl = ed.tl ? ed.tl - ed.buffer : -1;
 
-        struct tedchar *q = retreat(p);
+        assert(before + after <= capacity);
 
-        if (!q)
-                return p;
+        if (tl >= ed.gap_end - ed.buffer)
+                tl += (ptrdiff_t)capacity - (ptrdiff_t)ed.capacity;
 
-        struct tedchar *qq = q;
-        while (qq && !is_newline(*qq)) {
-                q = qq;
-                qq = retreat(qq);
-        }
+        if (capacity < ed.capacity)
+                memmove(ed.buffer + capacity - after, ed.gap_end, after);
 
-        size_t col = 0;
-        struct tedchar *r = q;
-        while (q != p) {
-                col = next_col(*q, col);
-                q = advance(q);
-                if (col == 0)
-                        r = q;
+        uint8_t *b = realloc(ed.buffer, capacity);
+        if (!b) {
+                if (capacity > ed.capacity)
+                        return false;
+                b = ed.buffer; /* Shrinking in place is always fine. */
         }
 
-        return r;
-}
+        if (capacity > ed.capacity)
+                memmove(b + capacity - after, b + ed.capacity - after, after);
 
-void point_mark_low_high(size_t *low, size_t *high)
-{
-        size_t p = where();
-        size_t m = ed.marks.m[ed.marks.current];
+        ed.buffer = b;
+        ed.capacity = capacity;
+        ed.gap_start = b + before;
+        ed.gap_end = b + capacity - after;
+        ed.tl = tl < 0 ? NULL : b + tl;
 
-        *low = p <= m ? p : m;
-        *high = p <= m ? m : p;
+        return true;
 }
 
-void refresh()
+/*
+  Make room for at least n bytes in the gap.
+*/
+bool grow_buffer(size_t n)
 {
-        hide_cursor();
+        size_t capacity = ed.capacity;
 
-        screenbuf_init();
+        while ((size_t)(ed.gap_end - ed.gap_start) + (capacity - ed.capacity) < n)
+                capacity *= 2;
 
-        size_t low = 0, high = 0;
+        if (capacity == ed.capacity)
+                return true;
 
-        if (ed.marks.is_active) {
-                point_mark_low_high(&low, &high);
-        }
+        return resize_buffer(capacity);
+}
+
+void shrink_buffer()
+{
+        size_t n = text_size();
+        size_t capacity = ed.capacity;
 
-        bool highlight_active = false;
+        while (capacity > MIN_BUFSIZE && n < capacity / 4)
+                capacity = capacity / 2 < MIN_BUFSIZE ? MIN_BUFSIZE : capacity / 2;
 
-        struct tedchar *current = ed.tl;
+        if (capacity < ed.capacity)
+                resize_buffer(capacity);
+}
 
-        for (size_t lines = 0; lines < ed.nlines; ++lines) {
-                size_t col = 0;
-                bool line = false;
-                bool newline = false;
+/*
+  Decode file contents into buffer text. Line endings become a single
+  '\n'. Returns the number of bytes written to dest and the number of
+  characters in nchars, or SIZE_MAX with a message in error.
+*/
+size_t text_from_bytes(uint8_t dest[], size_t n, const uint8_t src[], size_t m, size_t *nchars,
+                       const char **error)
+{
+        size_t i = 0;
+        size_t j = 0;
+        size_t c = 0;
 
-                while (current) {
-                        if (ed.marks.is_active && !highlight_active && index_of(current) >= low &&
-                            index_of(current) < high) {
-                                highlight_on();
-                                highlight_active = true;
+        while (j < m) {
+                size_t r = j;
+                while (r < m && 0x20 <= src[r] && src[r] <= 0x7e)
+                        ++r;
+
+                if (r > j) {
+                        assert(i + (r - j) <= n);
+                        memcpy(dest + i, src + j, r - j);
+                        i += r - j;
+                        c += r - j;
+                        j = r;
+                        continue;
+                }
+
+                if (ed.filetype == DOS && src[j] == '\r') {
+                        if (j + 1 < m && src[j + 1] == '\n') {
+                                dest[i++] = '\n';
+                                j += 2;
+                        } else {
+                                *error = "<cr> not followed by <lf> in file.\n";
+                                return SIZE_MAX;
+                        }
+                } else if (ed.filetype == UNIX && src[j] == '\n') {
+                        dest[i++] = '\n';
+                        ++j;
+                } else {
+                        size_t k = utf8_count(&src[j]);
+                        if (j + k - 1 >= m) {
+                                *error = "Invalid utf8 in file.\n";
+                                return SIZE_MAX;
                         }
 
-                        if (ed.marks.is_active && highlight_active && index_of(current) == high) {
-                                highlight_off();
-                                highlight_active = false;
+                        if (k == 1 && src[j] != '\t' && (src[j] < 0x20 || src[j] > 0x7e)) {
+                                *error = "Invalid ASCII in file.\n";
+                                return SIZE_MAX;
                         }
+                        for (size_t x = 1; x < k; ++x) {
+                                if (!is_continuation_byte(src[j + x])) {
+                                        *error = "Invalid utf8 in file.\n";
+                                        return SIZE_MAX;
+                                }
+                        }
+                        assert(i + k <= n);
+                        for (size_t x = 0; x < k; ++x)
+                                dest[i++] = src[j++];
+                }
+                ++c;
+        }
 
-                        line = true;
+        *nchars = c;
+        return i;
+}
+
+/*
+  Rebuild ed.lines and ed.checkpoints for a text that lies wholly after
+  the gap.
+*/
+static bool index_text()
+{
+        uint8_t *end = ed.buffer + ed.capacity;
+        size_t count = 0;
+
+        assert(ed.gap_start == ed.buffer);
+
+        for (uint8_t *q = ed.gap_end; (q = memchr(q, '\n', end - q)); ++q)
+                ++count;
+
+        ed.lines.before = 0;
+        ed.lines.after = 0;
+        if (!grow_lines(count))
+                return false;
+
+        ed.lines.after = count;
+        size_t k = ed.lines.capacity - count;
+        for (uint8_t *q = ed.gap_end; (q = memchr(q, '\n', end - q)); ++q)
+                ed.lines.nl[k++] = end - q;
+
+        ed.checkpoints.before = 0;
+        ed.checkpoints.after = 0;
+        add_checkpoints(0, 0, end - ed.gap_end);
+        checkpoints_move_gap(0);
+
+        return true;
+}
+
+void disable_mark()
+{
+        ed.marks.is_active = false;
+}
+
+/*
+  loadf() decodes only as much of the file as the first screen can
+  show. A thread decodes the rest while it is drawn, and
+  finish_loading() waits for it and indexes the whole text.
+*/
+struct {
+        pthread_t thread;
+        bool is_started;
+        const uint8_t *src;
+        size_t n;
+        size_t from;
+        uint8_t *text;
+        size_t m;
+        size_t nchars;
+        size_t capacity;
+        const char *error;
+} loading;
+
+static void *load_rest(void *arg)
+{
+        (void)arg;
+
+        size_t nchars;
+        size_t m = text_from_bytes(loading.text + loading.m, loading.n - loading.m,
+                                   loading.src + loading.from, loading.n - loading.from, &nchars,
+                                   &loading.error);
+
+        if (m != SIZE_MAX) {
+                loading.m += m;
+                loading.nchars = nchars;
+        }
+
+        return NULL;
+}
+
+/*
+  Returns false with a message in loading.error if the file turns out
+  not to be valid text or cannot be indexed.
+*/
+bool finish_loading()
+{
+        if (loading.is_started)
+                pthread_join(loading.thread, NULL);
+        else if (loading.from < loading.n)
+                load_rest(NULL);
+
+        if (loading.src)
+                munmap((void *)loading.src, loading.n);
+
+        if (loading.error) {
+                errno = 0;
+                return false;
+        }
+
+        size_t m = loading.m;
+
+        if (m < loading.n)
+                memmove(ed.buffer + loading.capacity - m, loading.text, m);
+
+        ed.capacity = loading.capacity;
+        ed.gap_end = ed.buffer + ed.capacity - m;
+        ed.nchars += loading.nchars;
+        if (!index_text()) {
+                loading.error = "loadf: malloc() failed";
+                return false;
+        }
+
+        ed.tl = m ? ed.gap_end : NULL;
+
+        return true;
+}
+
+void loadf(const char *filename)
+{
+        int fd;
+
+        char *rp = realpath(filename, NULL);
+        if (!rp) {
+                rp = strdup(filename);
+        }
+        if (!rp) {
+                perror("loadf: strdup() failed");
+                return;
+        }
+
+        char *d1 = strdup(rp);
+        char *b1 = strdup(rp);
+        if (!d1 || !b1) {
+                free(d1);
+                free(b1);
+                perror("loadf: strdup() failed");
+                return;
+        }
+
+        char *d = strdup(dirname(d1));
+        char *b = strdup(basename(b1));
+        if (!d || !b) {
+                free(d);
+                free(b);
+                perror("loadf: strdup() failed");
+                return;
+        }
+
+        free(d1);
+        free(b1);
+
+        struct stat st;
+
+        if (stat(d, &st)) {
+                perror("loadf: stat() failed");
+                goto err3;
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "loadf: '%s': not a directory.\n", d);
+                goto err3;
+        }
+
+        if (access(d, R_OK) != 0) {
+                fprintf(stderr, "loadf: Cannot read directory '%s'.\n", d);
+                goto err3;
+        }
+
+        if ((fd = open(filename, O_RDONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+                perror("loadf: Failed to open file");
+                goto err3;
+        }
+
+        if (fstat(fd, &st) < 0) {
+                perror("loadf: fstat() failed");
+                goto err2;
+        }
+
+        size_t n = st.st_size;
+        uint8_t *buf = NULL;
+
+        if (n) {
+                buf = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (buf == MAP_FAILED) {
+                        perror("loadf: mmap() failed");
+                        goto err2;
+                }
+        }
+
+        close(fd);
+
+        ed.capacity = n + n / 2;
+        if (ed.capacity < MIN_BUFSIZE)
+                ed.capacity = MIN_BUFSIZE;
+
+        ed.buffer = malloc(ed.capacity);
+        ed.checkpoints.capacity = 16;
+        ed.checkpoints.c = malloc(ed.checkpoints.capacity * sizeof(struct checkpoint));
+        ed.rows.capacity = 16;
+        ed.rows.r = malloc(ed.rows.capacity * sizeof(size_t));
+        ed.lines.capacity = 16;
+        ed.lines.nl = malloc(ed.lines.capacity * sizeof(size_t));
+        if (!ed.buffer || !ed.checkpoints.c || !ed.rows.r || !ed.lines.nl) {
+                perror("loadf: malloc() failed");
+                goto err1;
+        }
+
+        /*
+          Decode straight into the tail of the buffer so that point starts
+          at the beginning with the whole gap in front of it. Only DOS
+          line endings make the text shorter than the file. Until
+          finish_loading() the buffer ends after the first screen: a row
+          holds at most ncols characters of 4 bytes and a line ending.
+        */
+        size_t m = 0;
+        size_t p = min(n, (ed.nlines + 1) * (ed.ncols * 4 + 2));
+        const char *error = NULL;
+
+        while (p < n && is_continuation_byte(buf[p]))
+                ++p;
+        if (ed.filetype == DOS && p < n && buf[p - 1] == '\r' && buf[p] == '\n')
+                ++p;
+
+        loading.src = buf;
+        loading.n = n;
+        loading.from = p;
+        loading.text = ed.buffer + ed.capacity - n;
+        loading.capacity = ed.capacity;
+
+        ed.nchars = 0;
+        if (p) {
+                m = text_from_bytes(loading.text, n, buf, p, &ed.nchars, &error);
+                if (m == SIZE_MAX) {
+                        errno = 0;
+                        err_exit(error);
+                }
+        }
+
+        loading.m = m;
+        if (p < n)
+                loading.is_started = !pthread_create(&loading.thread, NULL, load_rest, NULL);
+
+        ed.capacity = loading.text + m - ed.buffer;
+
+        ed.filename = rp;
+        ed.dirname = d;
+        ed.basename = b;
+        ed.filemode = st.st_mode;
+        ed.mtime = st.st_mtim;
+
+        ed.ensure_trailing_newline = true;
+
+        ed.gap_start = ed.buffer;
+        ed.gap_end = loading.text;
+        ed.point_index = 0;
+        if (!index_text()) {
+                perror("loadf: malloc() failed");
+                goto err3;
+        }
+
+        ed.cursor_row = 0;
+        ed.cursor_col = 0;
+        ed.goal_col = 0;
+        ed.tl = m ? ed.gap_end : NULL;
+
+        ed.marks.len = 0;
+        ed.marks.first = 0;
+        ed.marks.last = 0;
+        ed.marks.current = 0;
+        ed.marks.is_active = false;
+
+        ed.search.kind = SEARCH_NONE;
+        ed.search.re = NULL;
+        ed.search.last = 0;
+        ed.search.current = 0;
+
+        ed.is_read_only = false;
+        ed.is_dirty = false;
+
+        ed.preserve_echo = false;
+
+        ed.kill_buffer = NULL;
+        ed.kill_size = 0;
+        ed.kill_capacity = 0;
+
+        return;
+
+err1:
+        if (buf)
+                munmap(buf, n);
+        exit(1);
+err2:
+        close(fd);
+err3:
+        exit(1);
+}
+
+uint8_t *advance(uint8_t *p)
+{
+        uint8_t *q = p + utf8_count(p);
+
+        if (p >= ed.gap_end) {
+                if (q < ed.buffer + ed.capacity)
+                        return q;
+                else
+                        return NULL;
+        }
+
+        if (q < ed.gap_start)
+                return q;
+
+        if (ed.gap_end < ed.buffer + ed.capacity)
+                return ed.gap_end;
+
+        return NULL;
+}
+
+uint8_t *retreat(uint8_t *p)
+{
+        if (p == ed.buffer)
+                return NULL;
+
+        if (p == ed.gap_end) {
+                if (ed.gap_start == ed.buffer)
+                        return NULL;
+                else
+                        p = ed.gap_start;
+        }
+
+        do
+                --p;
+        while (is_continuation_byte(*p));
+
+        return p;
+}
+
+size_t next_col(struct tedchar t, size_t col)
+{
+        assert(col < ed.ncols);
+
+        if (is_newline(t)) {
+                return 0;
+        } else if (is_tab(t)) {
+                size_t new_col = col + ed.tabstop - col % ed.tabstop;
+                if (new_col >= ed.ncols)
+                        return 0;
+                return new_col;
+        } else {
+                if (col + 1 >= ed.ncols)
+                        return 0;
+                return col + 1;
+        }
+}
+
+bool is_point_at_beginning_of_buffer()
+{
+        return ed.gap_start == ed.buffer;
+}
+
+bool is_point_at_end_of_buffer()
+{
+        return ed.gap_end == ed.buffer + ed.capacity;
+}
+
+bool is_buffer_empty()
+{
+        return ed.nchars == 0;
+}
+
+size_t buffer_size()
+{
+        return ed.nchars;
+}
+
+uint8_t *first_char()
+{
+        if (is_buffer_empty())
+                return NULL;
+
+        if (ed.gap_start > ed.buffer)
+                return ed.buffer;
+
+        return ed.gap_end;
+}
+
+uint8_t *char_at_point()
+{
+        if (is_buffer_empty() || is_point_at_end_of_buffer())
+                return NULL;
+
+        return ed.gap_end;
+}
+
+#define current_char() (assert(!is_point_at_end_of_buffer()), tedchar_at(char_at_point()))
+
+uint8_t *char_at_index(size_t i)
+{
+        if (i >= buffer_size())
+                return NULL;
+
+        if (i < ed.point_index && ed.point_index - i < CHECKPOINT_INTERVAL) {
+                uint8_t *p = ed.gap_start;
+                for (size_t n = ed.point_index - i; n; --n)
+                        do
+                                --p;
+                        while (is_continuation_byte(*p));
+                return p;
+        }
+
+        struct checkpoint c = nearest_checkpoint(SIZE_MAX, i);
+
+        return pointer_at(skip_chars(c.off, i - c.index));
+}
+
+size_t index_of(uint8_t *p)
+{
+        size_t before = ed.gap_start - ed.buffer;
+        size_t off = offset_of(p);
+
+        if (off < before && before - off < CHECKPOINT_INTERVAL)
+                return ed.point_index - count_chars(off, before);
+
+        struct checkpoint c = nearest_checkpoint(off, SIZE_MAX);
+
+        return c.index + count_chars(c.off, off);
+}
+
+size_t where()
+{
+        return ed.point_index;
+}
+
+static size_t new_temp_mark()
+{
+        ed.temp_marks.m[ed.temp_marks.len++] = where();
+        return ed.temp_marks.len - 1;
+}
+
+static size_t position_of_temp_mark(size_t temp_mark)
+{
+        return ed.temp_marks.m[temp_mark];
+}
+
+static void free_temp_mark(size_t temp_mark)
+{
+        assert(ed.temp_marks.len - 1 == temp_mark);
+        --ed.temp_marks.len;
+}
+
+static void update_marks_after_insert(size_t point, size_t n)
+{
+        size_t *marks = ed.marks.m;
+
+        for (size_t i = 0; i < ed.marks.len; ++i) {
+                size_t j = (ed.marks.first + i) % MARK_RING_SIZE;
+                if (marks[j] >= point)
+                        marks[j] += n;
+        }
+
+        for (size_t i = 0; i < ed.temp_marks.len; ++i)
+                if (ed.temp_marks.m[i] >= point)
+                        ed.temp_marks.m[i] += n;
+}
+
+/*
+  Marks inside the n deleted characters collapse onto point.
+*/
+static void update_marks_after_delete(size_t point, size_t n)
+{
+        size_t *marks = ed.marks.m;
+
+        for (size_t i = 0; i < ed.marks.len; ++i) {
+                size_t j = (ed.marks.first + i) % MARK_RING_SIZE;
+                if (marks[j] > point)
+                        marks[j] -= min(n, marks[j] - point);
+        }
+
+        for (size_t i = 0; i < ed.temp_marks.len; ++i)
+                if (ed.temp_marks.m[i] > point)
+                        ed.temp_marks.m[i] -= min(n, ed.temp_marks.m[i] - point);
+}
+
+/*
+  Find the start of the visual row after the one starting at offset s.
+  Returns false if the row is the last one of its line.
+*/
+static bool next_row_start(size_t s, size_t *next)
+{
+        size_t size = text_size();
+        size_t col = 0;
+        uint8_t *p = pointer_at(s);
+
+        while (s < size) {
+                struct tedchar t = tedchar_at(p);
+
+                if (is_newline(t))
+                        return false;
+
+                s += utf8_count(p);
+                col = next_col(t, col);
+                if (col == 0) {
+                        *next = s;
+                        return true;
+                }
+
+                p = advance(p);
+        }
+
+        return false;
+}
+
+/*
+  ed.rows.r holds the offsets at which the visual rows of one line
+  start, beginning with the line itself. It is filled in as far as
+  needed and cut back to the row containing an edit, so moving around a
+  long line only scans the rows it has not seen yet.
+*/
+static void invalidate_rows(size_t off)
+{
+        if (!ed.rows.len)
+                return;
+
+        if (off < ed.rows.r[0]) {
+                ed.rows.len = 0;
+                return;
+        }
+
+        while (ed.rows.r[ed.rows.len - 1] > off)
+                --ed.rows.len;
+        ed.rows.complete = false;
+}
+
+/*
+  Offset of the first character of the visual row containing offset off.
+*/
+size_t row_start_of(size_t off)
+{
+        size_t start = line_start_of(off);
+
+        if (!ed.rows.len || ed.rows.r[0] != start) {
+                ed.rows.r[0] = start;
+                ed.rows.len = 1;
+                ed.rows.complete = false;
+        }
+
+        while (!ed.rows.complete && ed.rows.r[ed.rows.len - 1] <= off) {
+                size_t next;
+
+                if (!next_row_start(ed.rows.r[ed.rows.len - 1], &next)) {
+                        ed.rows.complete = true;
+                        break;
+                }
+
+                if (ed.rows.len == ed.rows.capacity) {
+                        size_t capacity = ed.rows.capacity * 2;
+                        size_t *r = realloc(ed.rows.r, capacity * sizeof(size_t));
+                        if (!r) {
+                                /* Scan on without remembering the rows. */
+                                size_t s = ed.rows.r[ed.rows.len - 1];
+                                while (next <= off) {
+                                        s = next;
+                                        if (!next_row_start(s, &next))
+                                                break;
+                                }
+                                return s;
+                        }
+                        ed.rows.r = r;
+                        ed.rows.capacity = capacity;
+                }
+
+                ed.rows.r[ed.rows.len++] = next;
+        }
+
+        size_t lo = 0, hi = ed.rows.len;
+        while (hi - lo > 1) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (ed.rows.r[mid] <= off)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+
+        return ed.rows.r[lo];
+}
+
+size_t col_of(uint8_t *p)
+{
+        assert(p);
+
+        size_t off = offset_of(p);
+        size_t s = row_start_of(off);
+        size_t col = 0;
+
+        for (uint8_t *q = pointer_at(s); s < off; q = advance(q)) {
+                col = next_col(tedchar_at(q), col);
+                s += utf8_count(q);
+        }
+
+        return col;
+}
+
+uint8_t *first_of_visual_line(uint8_t *p)
+{
+        assert(p);
+
+        return pointer_at(row_start_of(offset_of(p)));
+}
+
+/*
+  Recompute the cursor position after point moved without stepping. The
+  viewport stays put if point is still on it. Otherwise point goes on the
+  last row, or on its own row if it is on the first screenful of text,
+  as if it had been reached by stepping forward from the beginning.
+*/
+void place_cursor()
+{
+        ed.cursor_col = col_of(ed.gap_end);
+
+        if (ed.tl && offset_of(ed.tl) <= offset_of(ed.gap_end)) {
+                size_t row = 0;
+                size_t col = 0;
+
+                for (uint8_t *p = ed.tl; p && p != ed.gap_end && row < ed.nlines;
+                     p = advance(p)) {
+                        col = next_col(tedchar_at(p), col);
+                        if (col == 0)
+                                ++row;
+                }
+
+                if (row < ed.nlines) {
+                        ed.cursor_row = row;
+                        return;
+                }
+        }
+
+        uint8_t *r = first_of_visual_line(ed.gap_end);
+        uint8_t *q;
+        size_t row = 0;
+
+        while (row < ed.nlines - 1 && (q = retreat(r))) {
+                r = first_of_visual_line(q);
+                ++row;
+        }
+
+        ed.tl = r;
+        ed.cursor_row = row;
+}
+
+void point_mark_low_high(size_t *low, size_t *high)
+{
+        size_t p = where();
+        size_t m = ed.marks.m[ed.marks.current];
+
+        *low = p <= m ? p : m;
+        *high = p <= m ? m : p;
+}
+
+static void find_visible_matches(size_t from, size_t to);
+
+/* Switch the text that follows to style. */
+static void set_style(int *current, int style)
+{
+        if (*current == style)
+                return;
+
+        if (*current != PLAIN)
+                highlight_off();
+
+        if (style == REGION)
+                highlight_on();
+        else if (style == MATCH)
+                match_on();
+        else if (style == CONTINUATION_LINE)
+                just_cstring(CONTINUATION_LINE_STR);
+        else if (style == EMPTY_LINE)
+                just_cstring(EMPTY_LINE_STR);
+
+        *current = style;
+}
+
+void frame_begin()
+{
+        frame.cur ^= 1;
+        frame.row = 0;
+        for (size_t i = 0; i < ed.nlines; ++i)
+                frame.len[frame.cur][i] = 0;
+}
+
+void frame_put(int style, struct utf8 u)
+{
+        size_t *len = &frame.len[frame.cur][frame.row];
+        struct cell *c = &frame.cells[frame.cur][frame.row][(*len)++];
+
+        assert(*len <= ed.ncols + 1);
+
+        *c = (struct cell){.style = style};
+        utf8_char_copy(c->u.c, u.c);
+}
+
+void frame_end_row()
+{
+        ++frame.row;
+}
+
+/*
+  Send the rows of the new frame that differ from the one on screen,
+  each from its first changed cell, and clear what is left of the old
+  row if the new one is shorter. Everything is sent if the screen
+  region has been cleared or moved since the last frame.
+*/
+void frame_draw()
+{
+        int style = PLAIN;
+
+        for (size_t r = 0; r < ed.nlines; ++r) {
+                struct cell *now = frame.cells[frame.cur][r];
+                struct cell *then = frame.cells[!frame.cur][r];
+                size_t n = frame.len[frame.cur][r];
+                size_t m = frame.is_valid ? frame.len[!frame.cur][r] : SIZE_MAX;
+                size_t d = 0;
+
+                if (frame.is_valid) {
+                        while (d < n && d < m && !memcmp(&now[d], &then[d], sizeof(*now)))
+                                ++d;
+                        if (d == n && d == m)
+                                continue;
+                }
+
+                emit_csi('H', ed.screen_begin.y + r, ed.screen_begin.x + d);
+
+                for (size_t i = d; i < n; ++i) {
+                        set_style(&style, now[i].style);
+                        just_utf8(now[i].u);
+                }
+
+                set_style(&style, PLAIN);
+                if (n < m)
+                        el();
+        }
+
+        frame.is_valid = true;
+}
+
+void refresh()
+{
+        hide_cursor();
+
+        size_t low = 0, high = 0;
+        size_t size = text_size();
+        size_t top = ed.tl ? offset_of(ed.tl) : 0;
+
+        if (ed.marks.is_active) {
+                point_mark_low_high(&low, &high);
+                low = low < buffer_size() ? offset_of(char_at_index(low)) : size;
+                high = high < buffer_size() ? offset_of(char_at_index(high)) : size;
+        }
+
+        find_visible_matches(top, min(size, top + ed.nlines * (ed.ncols * 4 + 1)));
+
+        size_t k = 0;
+
+        struct spans it = spans(top, size);
+        uint8_t *current = NULL;
+        uint8_t *end = NULL;
+        size_t n;
+
+        if (ed.tl && next_span(&it, &current, &n))
+                end = current + n;
+
+        frame_begin();
+
+        for (size_t lines = 0; lines < ed.nlines; ++lines) {
+                size_t col = 0;
+                bool line = false;
+
+                while (current) {
+                        size_t off = offset_of(current);
+                        int style = PLAIN;
+
+                        while (k < frame_matches.len && frame_matches.m[k].end <= off)
+                                ++k;
+
+                        if (low <= off && off < high)
+                                style = REGION;
+                        else if (k < frame_matches.len && frame_matches.m[k].start <= off)
+                                style = MATCH;
+
+                        line = true;
+
+                        struct tedchar t = tedchar_at(current);
 
                         assert(col <= ed.ncols);
 
-                        if (col == ed.ncols) {
-                                if (highlight_active)
-                                        highlight_off();
-                                just_cstring(CONTINUATION_LINE_STR);
-                                el();
-                                cr();
-                                lf();
-                                if (highlight_active)
-                                        highlight_on();
-                                break;
-                        } else if (is_newline(*current)) {
-                                newline = true;
-                                just_cstring(" ");
-                                el();
-                                cr();
-                                lf();
-                                current = advance(current);
-                                break;
-                        } else if (is_tab(*current)) {
-                                size_t new_col = next_col(*current, col);
-                                current = advance(current);
-                                if (new_col == 0) {
-                                        while (col < ed.ncols) {
-                                                just_cstring(" ");
-                                                ++col;
-                                        }
-                                        just_cstring(CONTINUATION_LINE_STR);
-                                        el();
-                                        cr();
-                                        lf();
-                                        break;
-                                } else {
-                                        while (col < new_col) {
-                                                just_cstring(" ");
-                                                ++col;
-                                        }
-                                }
-                        } else {
-                                assert(col < ed.ncols);
-                                just_utf8(current->u); // Assumes width-1.
+                        if (col == ed.ncols) {
+                                frame_put(CONTINUATION_LINE, utf8_ascii('\\'));
+                                break;
+                        } else if (is_newline(t)) {
+                                frame_put(style, utf8_ascii(' '));
+                                span_step(&it, &current, &end);
+                                break;
+                        } else if (is_tab(t)) {
+                                size_t new_col = next_col(t, col);
+                                span_step(&it, &current, &end);
+                                if (new_col == 0) {
+                                        while (col < ed.ncols) {
+                                                frame_put(style, utf8_ascii(' '));
+                                                ++col;
+                                        }
+                                        frame_put(CONTINUATION_LINE, utf8_ascii('\\'));
+                                        break;
+                                } else {
+                                        while (col < new_col) {
+                                                frame_put(style, utf8_ascii(' '));
+                                                ++col;
+                                        }
+                                }
+                        } else {
+                                assert(col < ed.ncols);
+                                frame_put(style, t.u); // Assumes width-1.
+
+                                size_t new_col = next_col(t, col);
+                                span_step(&it, &current, &end);
+                                if (new_col == 0) {
+                                        frame_put(CONTINUATION_LINE, utf8_ascii('\\'));
+                                        break;
+                                }
+                                col = new_col;
+                        }
+                }
+
+                if (!line)
+                        frame_put(EMPTY_LINE, utf8_ascii('~'));
+
+                frame_end_row();
+        }
+
+        frame_draw();
+
+        goto_((struct position){
+                .y = ed.screen_begin.y + ed.cursor_row,
+                .x = ed.screen_begin.x + ed.cursor_col,
+        });
+        show_cursor();
+}
+
+void previous_row();
+void next_row();
+void beginning_of_row();
+void end_of_row();
+void beginning_of_buffer();
+
+void scroll_down()
+{
+        if (is_buffer_empty())
+                return;
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (ed.cursor_row == ed.nlines - 1) {
+                        previous_row();
+                }
+
+                uint8_t *p = ed.tl;
+                if (!p)
+                        return;
+
+                uint8_t *q = retreat(p);
+                if (!q)
+                        return;
+
+                ed.tl = first_of_visual_line(q);
+                ++ed.cursor_row;
+        }
+}
+
+void scroll_up()
+{
+        if (is_buffer_empty())
+                return;
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (ed.cursor_row == 0) {
+                        next_row();
+                }
+
+                uint8_t *p = ed.tl;
+                size_t n = 0;
+
+                if (!p)
+                        return;
+
+                while (1) {
+                        n = next_col(tedchar_at(p), n);
+                        p = advance(p);
+                        if (!p)
+                                return;
+                        if (n == 0)
+                                break;
+                }
+
+                ed.tl = p;
+                --ed.cursor_row;
+        }
+}
+
+void forward_char()
+{
+        if (is_buffer_empty())
+                return;
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (is_point_at_end_of_buffer())
+                        return;
+
+                struct tedchar c = current_char();
+
+                if (ed.cursor_row == ed.nlines - 1 && next_col(c, ed.cursor_col) == 0) {
+                        scroll_up();
+                }
+
+                if (ed.cursor_row == 0 && ed.cursor_col == 0) {
+                        ed.tl = ed.gap_start;
+                }
+
+                size_t n = utf8_count(ed.gap_end);
+                memmove(ed.gap_start, ed.gap_end, n);
+                ed.gap_start += n;
+                ed.gap_end += n;
+                ++ed.point_index;
+                lines_move_gap(ed.gap_start - ed.buffer);
+                checkpoints_move_gap(ed.gap_start - ed.buffer);
+                if (next_col(c, ed.cursor_col) == 0) {
+                        ++ed.cursor_row;
+                }
+                ed.cursor_col = next_col(c, ed.cursor_col);
+
+                if (!ed.force_goal_col)
+                        ed.goal_col = ed.cursor_col;
+        }
+}
+
+void backward_char()
+{
+        if (is_buffer_empty())
+                return;
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (is_point_at_beginning_of_buffer())
+                        return;
+
+                if (ed.cursor_row == 0 && ed.cursor_col == 0) {
+                        scroll_down();
+                }
+
+                if (ed.gap_start > ed.buffer) {
+                        uint8_t *q = retreat(ed.gap_end);
+                        size_t n = ed.gap_start - q;
+                        ed.gap_start = q;
+                        ed.gap_end -= n;
+                        memmove(ed.gap_end, ed.gap_start, n);
+                        --ed.point_index;
+                        lines_move_gap(ed.gap_start - ed.buffer);
+                        checkpoints_move_gap(ed.gap_start - ed.buffer);
+                        if (is_newline(current_char()) || ed.cursor_col == 0)
+                                --ed.cursor_row;
+                        ed.cursor_col = col_of(ed.gap_end);
+                }
+
+                if (ed.cursor_row == 0 && ed.cursor_col == 0) {
+                        ed.tl = char_at_point();
+                }
+
+                if (!ed.force_goal_col)
+                        ed.goal_col = ed.cursor_col;
+        }
+}
+
+void forward_word()
+{
+        if (is_buffer_empty())
+                return;
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (is_point_at_end_of_buffer())
+                        return;
+
+                while (!is_point_at_end_of_buffer() && is_whitespace(current_char()))
+                        forward_char();
+
+                while (!is_point_at_end_of_buffer() && !is_whitespace(current_char()))
+                        forward_char();
+        }
+}
+
+bool is_point_at_beginning_of_word()
+{
+        if (is_buffer_empty())
+                return false;
+
+        if (is_point_at_end_of_buffer())
+                return false;
+
+        uint8_t *p = char_at_point();
+
+        if (is_point_at_beginning_of_buffer())
+                return !is_whitespace(tedchar_at(p));
+
+        uint8_t *q = retreat(p);
+
+        return !is_whitespace(tedchar_at(p)) && is_whitespace(tedchar_at(q));
+}
+
+void backward_word()
+{
+        if (is_buffer_empty())
+                return;
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (is_point_at_beginning_of_word() || is_point_at_end_of_buffer())
+                        backward_char();
+
+                while (is_whitespace(current_char())) {
+                        backward_char();
+                        if (is_point_at_beginning_of_buffer())
+                                return;
+                }
+
+                while (!is_whitespace(current_char())) {
+                        backward_char();
+                        if (is_point_at_beginning_of_buffer())
+                                return;
+                }
+
+                forward_char();
+        }
+}
+
+void forward_paragraph()
+{
+        if (is_buffer_empty())
+                return;
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (is_point_at_end_of_buffer())
+                        return;
+
+                while (!is_point_at_end_of_buffer() && is_whitespace(current_char()))
+                        forward_char();
+
+                size_t newline_run = 0;
+                while (!is_point_at_end_of_buffer()) {
+                        if (is_newline(current_char())) {
+                                ++newline_run;
+                                if (newline_run == 2)
+                                        break;
+                        } else {
+                                newline_run = 0;
+                        }
+
+                        forward_char();
+                }
+        }
+}
+
+void backward_paragraph()
+{
+        if (is_buffer_empty())
+                return;
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (is_point_at_beginning_of_buffer())
+                        return;
+
+                backward_char();
+
+                while (!is_point_at_beginning_of_buffer() && is_whitespace(current_char()))
+                        backward_char();
+
+                size_t newline_run = 0;
+                while (!is_point_at_beginning_of_buffer()) {
+                        if (is_newline(current_char())) {
+                                ++newline_run;
+                                if (newline_run == 2) {
+                                        while (!is_point_at_end_of_buffer() &&
+                                               is_whitespace(current_char()))
+                                                forward_char();
+                                        break;
+                                }
+                        } else {
+                                newline_run = 0;
+                        }
+
+                        backward_char();
+                }
+        }
+}
+
+void next_row()
+{
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (ed.cursor_row == ed.nlines - 1) {
+                        scroll_up();
+                }
+
+                size_t save_goal = ed.goal_col;
+
+                end_of_row();
+                forward_char();
+                beginning_of_row();
+
+                while (1) {
+                        uint8_t *p = char_at_point();
+                        if (ed.cursor_col >= save_goal || !p || is_newline(tedchar_at(p))) {
+                                ed.goal_col = save_goal;
+                                break;
+                        }
+                        forward_char();
+                }
+        }
+}
+
+void previous_row()
+{
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (ed.cursor_row == 0) {
+                        scroll_down();
+                }
+
+                size_t save_goal = ed.goal_col;
+
+                beginning_of_row();
+                backward_char();
+                beginning_of_row();
+
+                while (1) {
+                        uint8_t *p = char_at_point();
+
+                        if (ed.cursor_col >= save_goal || !p || is_newline(tedchar_at(p))) {
+                                ed.goal_col = save_goal;
+                                break;
+                        }
+
+                        forward_char();
+                }
+        }
+}
+
+void beginning_of_row()
+{
+        ed.is_prefix = false;
+
+        move_point(first_of_visual_line(ed.gap_end));
+        ed.cursor_col = 0;
+
+        if (!ed.force_goal_col)
+                ed.goal_col = 0;
+}
+
+void end_of_row()
+{
+        uint8_t *p = char_at_point();
+        while (p) {
+                size_t n = next_col(tedchar_at(p), ed.cursor_col);
+                if (n == 0)
+                        break;
+                forward_char();
+                p = char_at_point();
+        }
+}
+
+void beginning_of_line()
+{
+        if (is_buffer_empty())
+                return;
+
+        if (char_at_point() && is_newline(current_char()))
+                backward_char();
+
+        while (1) {
+                if (is_point_at_beginning_of_buffer())
+                        return;
+
+                if (char_at_point() && is_newline(current_char())) {
+                        forward_char();
+                        return;
+                }
+
+                backward_char();
+        }
+}
+
+void end_of_line()
+{
+        if (is_buffer_empty())
+                return;
+
+        while (!is_point_at_end_of_buffer() && !is_newline(current_char()))
+                forward_char();
+}
+
+/* Move point to byte offset off, or to the end if off is past it. */
+void move_to_offset(size_t off)
+{
+        if (is_buffer_empty())
+                return;
+
+        move_point(pointer_at(min(off, text_size())));
+        place_cursor();
+
+        if (!ed.force_goal_col)
+                ed.goal_col = ed.cursor_col;
+}
+
+void move_to(size_t n)
+{
+        if (n < buffer_size())
+                move_to_offset(offset_of(char_at_index(n)));
+        else
+                move_to_offset(text_size());
+}
+
+void goto_line()
+{
+        size_t line_no = ed.prefix_arg;
+
+        if (!ed.is_prefix || ed.prefix_arg < 1)
+                line_no = 1;
+
+        ed.is_prefix = false;
+
+        move_to_offset(line_offset(line_no));
+}
+
+void goto_percent()
+{
+        size_t percent = ed.prefix_arg;
+
+        if (!ed.is_prefix || ed.prefix_arg < 0)
+                percent = 0;
+        else if (ed.prefix_arg > 100)
+                percent = 100;
+
+        ed.is_prefix = false;
+
+        move_to((buffer_size() * percent) / 100);
+}
+
+void beginning_of_buffer()
+{
+        move_to(0);
+}
+
+void end_of_buffer()
+{
+        move_to(buffer_size());
+}
+
+void page_down()
+{
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                for (size_t i = 0; i < (ed.nlines + 2) / 2; ++i) {
+                        scroll_up();
+                        next_row();
+                }
+        }
+}
+
+void page_up()
+{
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                for (size_t i = 0; i < (ed.nlines + 2) / 2; ++i) {
+                        scroll_down();
+                        previous_row();
+                }
+        }
+}
+
+void set_goal_column()
+{
+        if (ed.is_prefix) {
+                ed.force_goal_col = false;
+        } else {
+                ed.force_goal_col = true;
+                ed.goal_col = ed.cursor_col;
+        }
+}
+
+bool is_textchar(struct key k)
+{
+        if (key_eq(k, kbd("<cr>")) || key_eq(k, kbd("<tab>")))
+                return true;
+
+        if (k.special)
+                return false;
+
+        if (k.ctrl || k.meta || k.super || k.shift)
+                return false;
+
+        if (utf8_count(k.u.c) == 1)
+                return 0x20 <= k.u.c[0] && k.u.c[0] <= 0x7e;
+
+        for (size_t i = 1; i < utf8_count(k.u.c); ++i)
+                if (!is_continuation_byte(k.u.c[i]))
+                        return false;
+
+        return true;
+}
+
+void do_insert_char(struct tedchar t)
+{
+        ed.is_dirty = true;
+
+        size_t p = where();
+
+        if (!grow_buffer(sizeof(t.u)) || (is_newline(t) && !grow_lines(1))) {
+                echo_error("Out of memory.");
+                return;
+        }
+
+        size_t off = ed.gap_start - ed.buffer;
+
+        if (is_newline(t))
+                ed.lines.nl[ed.lines.before++] = off;
+        if (ed.cursor_row == 0 && ed.cursor_col == 0)
+                ed.tl = ed.gap_start;
+        ed.gap_start += tedchar_to_bytes(ed.gap_start, t);
+        ++ed.nchars;
+        ++ed.point_index;
+        checkpoint_insertion();
+        invalidate_rows(off);
+        size_t new_col = next_col(t, ed.cursor_col);
+        if (new_col == 0) {
+                if (ed.cursor_row == ed.nlines - 1)
+                        scroll_up();
+                ++ed.cursor_row;
+        }
+        ed.cursor_col = new_col;
+        if (!ed.force_goal_col)
+                ed.goal_col = ed.cursor_col;
+
+        update_marks_after_insert(p, 1);
+}
+
+/*
+  Insert count copies of the n bytes of text at s before point. The
+  copies are laid down with one memcpy each, or a memset for a single
+  byte, and the cursor and viewport are worked out once at the end.
+*/
+void insert_text(const uint8_t *s, size_t n, size_t count)
+{
+        if (!n || !count)
+                return;
+
+        if (n > SIZE_MAX / count) {
+                echo_error("Out of memory.");
+                return;
+        }
+
+        size_t nbytes = n * count;
+        size_t nl = 0;
+
+        for (const uint8_t *q = s; (q = memchr(q, '\n', s + n - q)); ++q)
+                ++nl;
+
+        if (nl > SIZE_MAX / count || !grow_buffer(nbytes) || !grow_lines(nl * count)) {
+                echo_error("Out of memory.");
+                return;
+        }
+
+        ed.is_dirty = true;
+
+        size_t p = where();
+        size_t off = ed.gap_start - ed.buffer;
+        size_t nchars = count_span(s, n) * count;
+
+        if (ed.cursor_row == 0 && ed.cursor_col == 0)
+                ed.tl = ed.gap_start;
+
+        if (n == 1) {
+                memset(ed.gap_start, s[0], count);
+        } else {
+                for (size_t i = 0; i < nbytes; i += n)
+                        memcpy(ed.gap_start + i, s, n);
+        }
+
+        if (nl) {
+                uint8_t *end = ed.gap_start + nbytes;
+                for (uint8_t *q = ed.gap_start; (q = memchr(q, '\n', end - q)); ++q)
+                        ed.lines.nl[ed.lines.before++] = q - ed.buffer;
+        }
+
+        ed.gap_start += nbytes;
+        ed.nchars += nchars;
+        ed.point_index += nchars;
+        checkpoint_insertion();
+        invalidate_rows(off);
+        update_marks_after_insert(p, nchars);
+
+        place_cursor();
+        if (!ed.force_goal_col)
+                ed.goal_col = ed.cursor_col;
+}
+
+void insert_char()
+{
+        struct key k = ed.last_key;
+
+        assert(is_textchar(k));
+
+        guard(!ed.is_read_only);
+
+        struct tedchar t;
+
+        if (key_eq(k, kbd("<cr>")))
+                t = tedchar_newline();
+        else if (key_eq(k, kbd("<tab>")))
+                t = tedchar_utf8(utf8_ascii('\t'));
+        else
+                t = tedchar_utf8(k.u);
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        if (repeat == 1) {
+                do_insert_char(t);
+        } else {
+                uint8_t buf[sizeof(t.u)];
+                insert_text(buf, tedchar_to_bytes(buf, t), repeat);
+        }
+}
+
+void open_line()
+{
+        guard(!ed.is_read_only);
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                do_insert_char(tedchar_newline());
+                backward_char();
+        }
+}
+
+void open_next_line()
+{
+        guard(!ed.is_read_only);
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                end_of_line();
+                do_insert_char(tedchar_newline());
+        }
+}
+
+static void copy_indent_of_line(uint8_t *indent, size_t *i)
+{
+        size_t size = text_size();
+
+        *i = 0;
+        for (size_t off = line_start_of(ed.gap_start - ed.buffer); off < size && *i < LINE_MAX;
+             ++off) {
+                uint8_t c = *pointer_at(off);
+                if (c != ' ' && c != '\t')
+                        break;
+                indent[(*i)++] = c;
+        }
+}
+
+void newline_and_indent()
+{
+        guard(!ed.is_read_only);
+
+        uint8_t text[LINE_MAX + 1] = {'\n'};
+        size_t i = 0;
+
+        copy_indent_of_line(text + 1, &i);
+
+        insert_text(text, i + 1, 1);
+}
+
+void indent_current_line()
+{
+        guard(!ed.is_read_only);
+
+        size_t original = new_temp_mark();
+
+        beginning_of_line();
+        size_t line_start = new_temp_mark();
+
+        backward_char();
+
+        uint8_t text[LINE_MAX];
+        size_t n = 0;
+
+        for (size_t j = 0; j < ed.options.indent.len; ++j)
+                n += tedchar_to_bytes(text + n, ed.options.indent.c[j]);
+
+        move_to(position_of_temp_mark(line_start));
+        insert_text(text, n, 1);
+        move_to(position_of_temp_mark(original));
+
+        free_temp_mark(line_start);
+        free_temp_mark(original);
+}
+
+static bool point_matches(struct tedchar *s, size_t len)
+{
+        uint8_t *p = char_at_point();
+        for (size_t i = 0; i < len; ++i) {
+                if (!p)
+                        return false;
+                if (!tedchar_eq(s[i], tedchar_at(p)))
+                        return false;
+                p = advance(p);
+        }
+        return true;
+}
+
+void open_previous_line()
+{
+        guard(!ed.is_read_only);
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                beginning_of_line();
+                open_line();
+        }
+}
+
+/*
+  Delete the n characters after point by widening the gap over them.
+  Point, and with it the cursor, stays where it is.
+*/
+void delete_range(size_t n)
+{
+        size_t p = where();
+
+        if (n > buffer_size() - p)
+                n = buffer_size() - p;
+
+        if (!n)
+                return;
+
+        ed.is_dirty = true;
+
+        size_t off = ed.gap_start - ed.buffer;
+        size_t end = skip_chars(off, n);
+        size_t size = text_size();
+
+        while (ed.lines.after && size - ed.lines.nl[ed.lines.capacity - ed.lines.after] < end)
+                --ed.lines.after;
+
+        while (ed.checkpoints.after &&
+               size - ed.checkpoints.c[ed.checkpoints.capacity - ed.checkpoints.after].off < end)
+                --ed.checkpoints.after;
+
+        if (ed.tl == ed.gap_end)
+                ed.tl = end < size ? ed.gap_end + (end - off) : NULL;
+
+        ed.gap_end += end - off;
+        ed.nchars -= n;
+        invalidate_rows(off);
+        update_marks_after_delete(p, n);
+        shrink_buffer();
+}
+
+void delete_char()
+{
+        guard(!ed.is_read_only);
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        if (is_buffer_empty() || is_point_at_end_of_buffer())
+                return;
+
+        if (ed.cursor_row == ed.nlines - 1 && next_col(current_char(), ed.cursor_col) == 0)
+                scroll_up();
+
+        delete_range(repeat);
+}
+
+void dedent_current_line()
+{
+        guard(!ed.is_read_only);
+
+        size_t original = new_temp_mark();
+
+        beginning_of_line();
+        struct tedchar *s = &ed.options.indent.c[0];
+        size_t len = ed.options.indent.len;
+        if (point_matches(s, len))
+                delete_range(len);
+
+        move_to(position_of_temp_mark(original));
+        free_temp_mark(original);
+}
+
+void delete_region()
+{
+        guard(!ed.is_read_only);
+
+        size_t low, high;
+
+        point_mark_low_high(&low, &high);
+
+        uint8_t *p = char_at_index(low);
+
+        if (!p)
+                return;
+
+        if (high == low)
+                return;
+
+        move_to(low);
+        delete_range(high - low);
+}
+
+void delete_backward_char()
+{
+        guard(!ed.is_read_only);
+
+        if (ed.marks.is_active) {
+                delete_region();
+                disable_mark();
+                return;
+        }
+
+        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+
+        ed.is_prefix = false;
+
+        while (repeat--) {
+                if (is_buffer_empty() || is_point_at_beginning_of_buffer())
+                        return;
+
+                backward_char();
+                delete_char();
+        }
+}
+
+void delete_forward_char()
+{
+        guard(!ed.is_read_only);
+
+        if (ed.marks.is_active) {
+                delete_region();
+                disable_mark();
+                return;
+        }
+
+        delete_char();
+}
+
+/*
+  Add the marks and the temporary marks to the na indices in at[], and
+  sort them all by the index they hold. Returns the new count.
+*/
+static size_t sort_indices(size_t *at[], size_t na)
+{
+        for (size_t i = 0; i < ed.marks.len; ++i)
+                at[na++] = &ed.marks.m[(ed.marks.first + i) % MARK_RING_SIZE];
+        for (size_t i = 0; i < ed.temp_marks.len; ++i)
+                at[na++] = &ed.temp_marks.m[i];
+
+        for (size_t i = 1; i < na; ++i)
+                for (size_t j = i; j && *at[j - 1] > *at[j]; --j) {
+                        size_t *t = at[j];
+                        at[j] = at[j - 1];
+                        at[j - 1] = t;
+                }
+
+        return na;
+}
+
+/*
+  Carry the na sorted indices in at[] through replacing the k character
+  ranges in e, which are in order and index the text before the edit,
+  with rc characters each. Indices inside a range end up after its
+  replacement.
+*/
+static void remap_indices(size_t *at[], size_t na, const struct match e[], size_t k, size_t rc)
+{
+        size_t shift = 0;
+        size_t a = 0;
+
+        for (size_t j = 0; j < k; ++j) {
+                for (; a < na && *at[a] <= e[j].start; ++a)
+                        *at[a] += shift;
+                for (; a < na && *at[a] < e[j].end; ++a)
+                        *at[a] = e[j].start + shift + rc;
+                shift += rc - (e[j].end - e[j].start);
+        }
+
+        for (; a < na; ++a)
+                *at[a] += shift;
+}
+
+/*
+  Replace the len bytes after point with the n bytes at r, leaving
+  point after them. Unlike delete_range and insert_text, the marks and
+  the cursor are left for the caller to fix once a batch of these is
+  done. Sets deleted to the number of characters replaced.
+*/
+static bool replace_at_point(size_t len, const uint8_t *r, size_t n, size_t *deleted)
+{
+        size_t nl = 0;
+
+        for (const uint8_t *q = r; (q = memchr(q, '\n', r + n - q)); ++q)
+                ++nl;
+
+        if (!grow_buffer(n) || !grow_lines(nl))
+                return false;
+
+        size_t off = ed.gap_start - ed.buffer;
+        size_t end = off + len;
+        size_t size = text_size();
+        size_t tl = ed.tl ? offset_of(ed.tl) : SIZE_MAX;
+        size_t c = count_chars(off, end);
+        size_t rc = count_span(r, n);
+
+        while (ed.lines.after && size - ed.lines.nl[ed.lines.capacity - ed.lines.after] < end)
+                --ed.lines.after;
+
+        while (ed.checkpoints.after &&
+               size - ed.checkpoints.c[ed.checkpoints.capacity - ed.checkpoints.after].off < end)
+                --ed.checkpoints.after;
+
+        ed.gap_end += len;
+        memcpy(ed.gap_start, r, n);
+        for (uint8_t *q = ed.gap_start; (q = memchr(q, '\n', ed.gap_start + n - q)); ++q)
+                ed.lines.nl[ed.lines.before++] = q - ed.buffer;
+        ed.gap_start += n;
+        ed.nchars = ed.nchars - c + rc;
+        add_checkpoints(off, ed.point_index, off + n);
+        ed.point_index += rc;
+        invalidate_rows(off);
+        ed.is_dirty = true;
+
+        if (tl != SIZE_MAX && tl >= off) {
+                tl = tl < end ? off : tl - len + n;
+                ed.tl = tl < text_size() ? pointer_at(tl) : NULL;
+        }
+
+        *deleted = c;
+        return true;
+}
+
+/*
+  Replace the k matches in m, which are in order and do not overlap,
+  with the n bytes at r. The text is copied once into a new buffer with
+  the replacements in place, so the cost does not grow with the number
+  of matches. Point and the marks move with the text around them; those
+  inside a match end up after its replacement.
+*/
+bool replace_matches(const struct match m[], size_t k, const uint8_t *r, size_t n)
+{
+        size_t size = text_size();
+        size_t removed = 0;
+        size_t nl = 0;
+
+        for (const uint8_t *q = r; (q = memchr(q, '\n', r + n - q)); ++q)
+                ++nl;
+
+        for (size_t j = 0; j < k; ++j)
+                removed += m[j].end - m[j].start;
+
+        if ((n && k > (SIZE_MAX - size) / n) || (nl && k > SIZE_MAX / nl) || !grow_lines(k * nl))
+                return false;
+
+        size_t new_size = size - removed + k * n;
+        size_t capacity = new_size + new_size / 2;
+        if (capacity < MIN_BUFSIZE)
+                capacity = MIN_BUFSIZE;
+
+        uint8_t *buffer = malloc(capacity);
+        if (!buffer)
+                return false;
+
+        /*
+          Every character index to carry through the edit, in order, so
+          that one walk along the matches maps them all.
+        */
+        size_t *at[MARK_RING_SIZE + TEMP_MARKS_SIZE + 2];
+        size_t na = 0;
+        size_t point = where();
+        size_t tl = ed.tl ? index_of(ed.tl) : 0;
+
+        at[na++] = &point;
+        at[na++] = &tl;
+        na = sort_indices(at, na);
+
+        uint8_t *d = buffer + capacity - new_size;
+        size_t rc = count_span(r, n);
+        size_t off = 0;
+        size_t i = 0;
+        size_t ni = 0;
+        size_t a = 0;
+
+        for (size_t j = 0; j <= k; ++j) {
+                size_t s = j < k ? m[j].start : size;
+
+                copy_text(d, off, s);
+                size_t c = count_span(d, s - off);
+                d += s - off;
+
+                for (; a < na && *at[a] <= i + c; ++a)
+                        *at[a] = *at[a] - i + ni;
+                i += c;
+                ni += c;
+
+                if (j == k)
+                        break;
+
+                c = count_chars(s, m[j].end);
+                memcpy(d, r, n);
+                d += n;
+
+                for (; a < na && *at[a] < i + c; ++a)
+                        *at[a] = ni + rc;
+                i += c;
+                ni += rc;
+                off = m[j].end;
+        }
+
+        free(ed.buffer);
+        ed.buffer = buffer;
+        ed.capacity = capacity;
+        ed.gap_start = buffer;
+        ed.gap_end = buffer + capacity - new_size;
+        ed.nchars = ni;
+        ed.point_index = 0;
+        ed.rows.len = 0;
+        ed.cursor_row = 0;
+        ed.cursor_col = 0;
+        ed.is_dirty = true;
+
+        index_text(); /* Cannot fail, the line table was grown above. */
+
+        ed.tl = ni ? first_of_visual_line(char_at_index(min(tl, ni - 1))) : NULL;
+        move_to(point);
+
+        return true;
+}
+
+static void maybe_insert_trailing_newline()
+{
+        if (!ed.ensure_trailing_newline || is_buffer_empty())
+                return;
+
+        uint8_t *p = char_at_index(buffer_size() - 1);
+        if (is_newline(tedchar_at(p)))
+                return;
+
+        if (is_point_at_end_of_buffer()) {
+                do_insert_char(tedchar_newline());
+        } else {
+                size_t save = where();
+
+                end_of_buffer();
+                do_insert_char(tedchar_newline());
+
+                move_to(save);
+        }
+}
+
+int write_all(int fd, uint8_t *buf, size_t n)
+{
+        ssize_t r;
+        int retries = 10;
+
+        while (n) {
+                r = write(fd, buf, n);
+                if (r > 0) {
+                        n -= r;
+                } else if (r < 0) {
+                        switch (errno) {
+                        case EINTR:
+                                if (!retries)
+                                        return EINTR;
+                                --retries;
+                                break;
+                        default:
+                                return r;
+                        }
+                } else {
+                        if (!retries)
+                                return EAGAIN;
+                        --retries;
+                }
+        }
+
+        return 0;
+}
+
+int open_save_file(const char *dirname, const char *basename, char *buf, size_t n)
+{
+        int fd;
+        int flags = O_CREAT | O_TRUNC | O_WRONLY | O_EXCL;
+
+        for (int i = 0; i < 100; ++i) {
+                snprintf(buf, n, "%s/.%s.%d", dirname, basename, i);
+                if (access(buf, F_OK)) {
+                        fd = open(buf, flags, ed.filemode);
+                        return fd;
+                }
+        }
+
+        return -1;
+}
+
+bool timespec_lt(struct timespec a, struct timespec b)
+{
+        return a.tv_sec < b.tv_sec || a.tv_nsec < b.tv_nsec;
+}
+
+/*
+  UNIX files are written straight from the buffer. DOS files go through
+  a staging buffer to put back the carriage returns.
+*/
+void write_buffer_to_file(int fd)
+{
+        struct spans it = spans(0, text_size());
+        uint8_t *p;
+        size_t n;
+
+        if (ed.filetype == UNIX) {
+                while (next_span(&it, &p, &n))
+                        if (write_all(fd, p, n))
+                                return;
+                return;
+        }
+
+        uint8_t buf[BUFSIZE];
+        size_t i = 0;
+
+        while (next_span(&it, &p, &n)) {
+                while (n) {
+                        uint8_t *nl = memchr(p, '\n', n);
+                        size_t k = nl ? (size_t)(nl - p) : n;
+
+                        while (k) {
+                                size_t m = min(k, BUFSIZE - i);
+                                memcpy(buf + i, p, m);
+                                i += m;
+                                p += m;
+                                n -= m;
+                                k -= m;
+                                if (i == BUFSIZE) {
+                                        if (write_all(fd, buf, i))
+                                                return;
+                                        i = 0;
+                                }
+                        }
+
+                        if (nl) {
+                                if (i + 2 > BUFSIZE) {
+                                        if (write_all(fd, buf, i))
+                                                return;
+                                        i = 0;
+                                }
+                                buf[i++] = '\r';
+                                buf[i++] = '\n';
+                                ++p;
+                                --n;
+                        }
+                }
+        }
+
+        write_all(fd, buf, i);
+}
+
+void save_buffer()
+{
+        maybe_insert_trailing_newline();
+
+        char pathbuf[PATH_MAX];
+
+        int fd = open_save_file(ed.dirname, ed.basename, pathbuf, PATH_MAX);
+        if (fd < 0) {
+                fd = open_save_file(P_tmpdir, ed.basename, pathbuf, PATH_MAX);
+                if (fd < 0) {
+                        echo_error("Failed to save file.");
+                        return;
+                }
+        }
+
+        write_buffer_to_file(fd);
+
+        if (close(fd)) {
+                echo_error("Failed to save file.");
+                return;
+        }
+
+        struct stat st;
+        stat(ed.filename, &st);
+
+        if (timespec_lt(ed.mtime, st.st_mtim)) {
+                echo_error("File has been modified. Wrote to \'%s\'", pathbuf);
+                return;
+        }
+
+        if (rename(pathbuf, ed.filename)) {
+                echo_error("\'%s\' rename failed.", pathbuf);
+                return;
+        }
+
+        unlink(pathbuf);
+
+        echo_info_preserve("Wrote \'%s\'", ed.filename);
+        ed.is_dirty = false;
+        if (!stat(ed.filename, &st))
+                ed.mtime = st.st_mtim;
+}
+
+void do_push_mark(size_t w)
+{
+        ed.marks.m[ed.marks.last] = w;
+        ed.marks.current = ed.marks.last;
+        ed.marks.last = (ed.marks.last + 1) % MARK_RING_SIZE;
+
+        if (ed.marks.len == MARK_RING_SIZE)
+                ++ed.marks.first;
+        else
+                ++ed.marks.len;
+}
+
+void exchange_point_and_mark()
+{
+        if (is_buffer_empty())
+                return;
+
+        if (!ed.marks.len)
+                return;
+
+        size_t save = ed.marks.m[ed.marks.current];
+        ed.marks.m[ed.marks.current] = where();
+
+        move_to(save);
+}
+
+void set_mark()
+{
+        if (ed.is_prefix) {
+                if (!ed.marks.len)
+                        return;
+
+                exchange_point_and_mark();
+
+                if (ed.marks.len <= 1)
+                        return;
+
+                if (ed.marks.current == ed.marks.first)
+                        if (ed.marks.last > 0)
+                                ed.marks.current = ed.marks.last - 1;
+                        else
+                                ed.marks.current = MARK_RING_SIZE - 1;
+                else if (ed.marks.current == 0)
+                        ed.marks.current = MARK_RING_SIZE - 1;
+                else
+                        ed.marks.current -= 1;
+                return;
+        }
+
+        do_push_mark(where());
+        ed.marks.is_active = true;
+}
+
+void set_mark_forward_word()
+{
+        set_mark();
+        forward_word();
+}
+
+void set_mark_backward_word()
+{
+        set_mark();
+        backward_word();
+}
+
+void set_mark_forward_paragraph()
+{
+        set_mark();
+        forward_paragraph();
+}
+
+void set_mark_backward_paragraph()
+{
+        set_mark();
+        backward_paragraph();
+}
+
+void set_mark_next_row()
+{
+        set_mark();
+        next_row();
+}
+
+void set_mark_previous_row()
+{
+        set_mark();
+        previous_row();
+}
+
+void set_mark_forward_char()
+{
+        set_mark();
+        forward_char();
+}
+
+void set_mark_backward_char()
+{
+        set_mark();
+        backward_char();
+}
+
+void kill_region_save()
+{
+        guard(!ed.is_read_only);
+
+        if (!ed.marks.is_active)
+                return;
+
+        ed.kill_size = 0;
+
+        size_t low, high;
+
+        point_mark_low_high(&low, &high);
 
-                                size_t new_col = next_col(*current, col);
-                                current = advance(current);
-                                if (new_col == 0) {
-                                        if (highlight_active)
-                                                highlight_off();
-                                        just_cstring(CONTINUATION_LINE_STR);
-                                        el();
-                                        cr();
-                                        lf();
-                                        if (highlight_active)
-                                                highlight_on();
-                                        break;
-                                }
-                                col = new_col;
-                        }
-                }
+        uint8_t *t = char_at_index(low);
+        uint8_t *last = char_at_index(high);
 
-                if (!line) {
-                        if (highlight_active)
-                                highlight_off();
-                        just_cstring(EMPTY_LINE_STR);
-                        el();
-                        cr();
-                        lf();
-                        if (highlight_active)
-                                highlight_on();
-                } else if (!newline && !current) {
-                        el();
-                        cr();
-                        lf();
+        size_t from = t ? offset_of(t) : text_size();
+        size_t to = last ? offset_of(last) : text_size();
+
+        if (to - from > ed.kill_capacity) {
+                uint8_t *k = realloc(ed.kill_buffer, to - from);
+                if (!k) {
+                        echo_error("Out of memory.");
+                        return;
                 }
+                ed.kill_buffer = k;
+                ed.kill_capacity = to - from;
         }
 
-        screenbuf_draw();
+        copy_text(ed.kill_buffer, from, to);
+        ed.kill_size = to - from;
 
-        goto_((struct position){
-                .y = ed.screen_begin.y + ed.cursor_row,
-                .x = ed.screen_begin.x + ed.cursor_col,
-        });
-        show_cursor();
+        ed.marks.is_active = false;
 }
 
-void previous_row();
-void next_row();
-void beginning_of_row();
-void end_of_row();
-void beginning_of_buffer();
-
-void scroll_down()
+void kill_region()
 {
-        if (is_buffer_empty())
+        guard(!ed.is_read_only);
+
+        if (!ed.marks.is_active)
                 return;
 
+        kill_region_save();
+
+        size_t low, high;
+
+        point_mark_low_high(&low, &high);
+
+        move_to(low);
+        delete_range(high - low);
+
+        ed.marks.is_active = false;
+}
+
+void yank()
+{
+        guard(!ed.is_read_only);
+
         size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
 
         ed.is_prefix = false;
 
-        while (repeat--) {
-                if (ed.cursor_row == ed.nlines - 1) {
-                        previous_row();
+        insert_text(ed.kill_buffer, ed.kill_size, repeat);
+}
+
+void show_line_column()
+{
+        size_t point = ed.gap_start - ed.buffer;
+        size_t col_no = count_chars(line_offset(line_number()), point) + 1;
+
+        echo_info_preserve("L%zuC%zu", line_number(), col_no);
+}
+
+void toggle_read_only_mode()
+{
+        ed.is_read_only = !ed.is_read_only;
+        echo_info_preserve("Read-Only mode %s.", ed.is_read_only ? "enabled" : "disabled");
+}
+
+void isearch(bool backward);
+
+static void goto_search_result(size_t i)
+{
+        ed.search.current = i;
+        move_to_offset(ed.search.results[i]);
+}
+
+static bool add_search_result(size_t off)
+{
+        if (ed.search.last == ed.search.capacity) {
+                size_t capacity = ed.search.capacity ? ed.search.capacity * 2 : SEARCH_SIZE;
+                size_t *r = realloc(ed.search.results, capacity * sizeof(size_t));
+                if (!r)
+                        return false;
+                ed.search.results = r;
+                ed.search.capacity = capacity;
+        }
+
+        ed.search.results[ed.search.last++] = off;
+
+        return true;
+}
+
+static bool text_matches(size_t off, const uint8_t *q, size_t m)
+{
+        struct spans it = spans(off, off + m);
+        uint8_t *p;
+        size_t n;
+
+        while (next_span(&it, &p, &n)) {
+                if (memcmp(p, q, n))
+                        return false;
+                q += n;
+        }
+
+        return true;
+}
+
+/*
+  Offset of the first occurrence of the query that starts in [from,
+  limit), or SIZE_MAX if there is none. Candidates come from memchr on
+  the first byte and are checked with memcmp, or piece by piece if they
+  straddle the gap or limit. Occurrences may overlap.
+*/
+static size_t scan_literal(size_t from, size_t limit)
+{
+        const uint8_t *q = ed.search.query;
+        size_t m = ed.search.len;
+        size_t size = text_size();
+        struct spans it = spans(from, min(limit, size));
+        uint8_t *p;
+        size_t n;
+
+        while (next_span(&it, &p, &n)) {
+                size_t base = it.from - n;
+                uint8_t *end = p + n;
+                uint8_t *s = p;
+
+                while (s < end && (s = memchr(s, q[0], end - s))) {
+                        size_t o = base + (s - p);
+
+                        if (o + m > size)
+                                return SIZE_MAX;
+
+                        if (s + m <= end ? !memcmp(s, q, m) : text_matches(o, q, m))
+                                return o;
+
+                        ++s;
                 }
+        }
 
-                struct tedchar *p = ed.tl;
-                if (!p)
-                        return;
+        return SIZE_MAX;
+}
 
-                struct tedchar *q = retreat(p);
-                if (!q)
-                        return;
+/*
+  Offset of the last occurrence of the query that starts in [from,
+  before), or SIZE_MAX if there is none.
+*/
+static size_t scan_literal_before(size_t from, size_t before)
+{
+        const uint8_t *q = ed.search.query;
+        size_t m = ed.search.len;
+        size_t size = text_size();
+        size_t gap = ed.gap_start - ed.buffer;
+        size_t hi = size < m ? 0 : min(before, size - m + 1);
 
-                ed.tl = first_of_visual_line(q);
-                ++ed.cursor_row;
+        while (hi > from) {
+                size_t lo = hi > gap && gap > from ? gap : from;
+                const uint8_t *p = pointer_at(lo);
+
+                for (size_t i = hi - lo; i--;)
+                        if (p[i] == q[0] && text_matches(lo + i, q, m))
+                                return lo + i;
+
+                hi = lo;
         }
+
+        return SIZE_MAX;
 }
 
-void scroll_up()
+/*
+  Long literal scans are split into chunks of at least SEARCH_CHUNK
+  bytes that are scanned on up to ed.nthreads threads. The threads only
+  read the text, and the editor waits for all of them, so nothing else
+  needs locking. A chunk owns the occurrences that start in it, and may
+  read past its end to check one, so chunks need no overlap.
+*/
+struct chunk {
+        size_t index;
+        size_t from;
+        size_t to;
+        size_t point;
+        size_t found;
+        size_t n;
+        size_t before;
+};
+
+static void *find_in_chunk(void *arg)
 {
-        if (is_buffer_empty())
-                return;
+        struct chunk *c = arg;
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        c->found = scan_literal(c->from, c->to);
 
-        ed.is_prefix = false;
+        return NULL;
+}
 
-        while (repeat--) {
-                if (ed.cursor_row == 0) {
-                        next_row();
+static void *find_in_chunk_before(void *arg)
+{
+        struct chunk *c = arg;
+
+        c->found = scan_literal_before(c->from, c->to);
+
+        return NULL;
+}
+
+/*
+  Set by the first chunk to see a key waiting, so that a count stops on
+  every thread. Each chunk looks for keys itself between slices of
+  SEARCH_CHUNK bytes, with poll() rather than key_pending(), which is
+  only safe on the editor's thread.
+*/
+static atomic_bool is_count_stopped;
+
+static void *count_in_chunk(void *arg)
+{
+        struct chunk *c = arg;
+        struct pollfd p = {.fd = STDIN_FILENO, .events = POLLIN};
+        size_t o;
+
+        c->n = c->before = 0;
+        for (size_t lo = c->from; lo < c->to; lo += SEARCH_CHUNK) {
+                size_t hi = c->to - lo > SEARCH_CHUNK ? lo + SEARCH_CHUNK : c->to;
+
+                if (is_count_stopped || poll(&p, 1, 0) > 0) {
+                        is_count_stopped = true;
+                        return NULL;
                 }
 
-                struct tedchar *p = ed.tl;
-                size_t n = 0;
+                for (size_t from = lo; (o = scan_literal(from, hi)) != SIZE_MAX; from = o + 1) {
+                        ++c->n;
+                        c->before += o < c->point;
+                }
+        }
 
-                if (!p)
-                        return;
+        return NULL;
+}
 
-                while (1) {
-                        n = next_col(*p, n);
-                        p = advance(p);
-                        if (!p)
-                                return;
-                        if (n == 0)
-                                break;
+/*
+  Split [from, to) into chunks and run f on each of them, one per
+  thread. A chunk whose thread cannot be started is run here instead.
+  Returns the number of chunks.
+*/
+static size_t run_chunks(void *(*f)(void *), struct chunk c[], size_t from, size_t to)
+{
+        size_t k = min(ed.nthreads, (to - from) / SEARCH_CHUNK);
+        size_t len;
+        pthread_t t[MAX_THREADS];
+        bool is_started[MAX_THREADS];
+
+        k = k ? k : 1;
+        len = (to - from) / k;
+
+        for (size_t i = 0; i < k; ++i) {
+                c[i].index = i;
+                c[i].from = from + i * len;
+                c[i].to = i + 1 == k ? to : c[i].from + len;
+                c[i].point = ed.gap_start - ed.buffer;
+                is_started[i] = i && !pthread_create(&t[i], NULL, f, &c[i]);
+        }
+
+        for (size_t i = 0; i < k; ++i)
+                if (!is_started[i])
+                        f(&c[i]);
+
+        for (size_t i = 0; i < k; ++i)
+                if (is_started[i])
+                        pthread_join(t[i], NULL);
+
+        return k;
+}
+
+/*
+  Like scan_literal. The first SEARCH_CHUNK bytes are scanned alone,
+  since the next match is usually close, and the rest in parallel.
+*/
+static size_t find_literal(size_t from, size_t limit)
+{
+        struct chunk c[MAX_THREADS];
+        size_t o;
+
+        limit = min(limit, text_size());
+        if (ed.nthreads == 1 || from + 2 * SEARCH_CHUNK >= limit)
+                return scan_literal(from, limit);
+
+        if ((o = scan_literal(from, from + SEARCH_CHUNK)) != SIZE_MAX)
+                return o;
+
+        size_t k = run_chunks(find_in_chunk, c, from + SEARCH_CHUNK, limit);
+        for (size_t i = 0; i < k; ++i)
+                if (c[i].found != SIZE_MAX)
+                        return c[i].found;
+
+        return SIZE_MAX;
+}
+
+/* Like find_literal, for the last occurrence that starts before before. */
+static size_t find_literal_before(size_t before)
+{
+        struct chunk c[MAX_THREADS];
+        size_t o;
+
+        before = min(before, text_size());
+        if (ed.nthreads == 1 || 2 * SEARCH_CHUNK >= before)
+                return scan_literal_before(0, before);
+
+        if ((o = scan_literal_before(before - SEARCH_CHUNK, before)) != SIZE_MAX)
+                return o;
+
+        for (size_t i = run_chunks(find_in_chunk_before, c, 0, before - SEARCH_CHUNK); i--;)
+                if (c[i].found != SIZE_MAX)
+                        return c[i].found;
+
+        return SIZE_MAX;
+}
+
+/*
+  Count the occurrences, and how many of them start before point.
+  Returns false if a key arrived before the count was done.
+*/
+static bool count_literal(size_t *n, size_t *before)
+{
+        struct chunk c[MAX_THREADS];
+
+        is_count_stopped = false;
+        size_t k = run_chunks(count_in_chunk, c, 0, text_size());
+
+        *n = *before = 0;
+        for (size_t i = 0; i < k; ++i) {
+                *n += c[i].n;
+                *before += c[i].before;
+        }
+
+        return !is_count_stopped;
+}
+
+/*
+  Regular expressions. A pattern is parsed into a tree, and the tree is
+  compiled into two NFA programs, one that reads the text forward and
+  one that reads it backward. The programs are run as DFAs whose states
+  are built the first time they are reached and then cached, so each
+  byte of text costs one table lookup and nothing ever backtracks. If
+  the cache fills up, it is thrown away and built again as needed.
+
+  The syntax is: literal characters, ., [...] and [^...], the classes
+  \d, \w and \s, \n and \t, escaped metacharacters, grouping with (), |,
+  *, + and ?, and the anchors ^ and $ at the start and end of a line.
+  Neither . nor [^...] matches a newline, and ranges in a class must be
+  ASCII.
+*/
+enum {
+        RE_EMPTY,
+        RE_BYTES,
+        RE_CAT,
+        RE_ALT,
+        RE_STAR,
+        RE_PLUS,
+        RE_QUEST,
+        RE_BOL,
+        RE_EOL,
+};
+
+struct re_node {
+        int kind;
+        size_t l;
+        size_t r;
+        uint8_t set[32];
+};
+
+enum {
+        OP_BYTES,
+        OP_SPLIT,
+        OP_JMP,
+        OP_AFTER_NL, /* The last byte read was a newline, or no byte was. */
+        OP_BEFORE_NL, /* The next byte is a newline, or there is none. */
+        OP_MATCH,
+};
+
+struct re_inst {
+        int op;
+        size_t x;
+        size_t y;
+        uint8_t set[32];
+};
+
+struct re_prog {
+        struct re_inst *inst;
+        size_t len;
+        size_t capacity;
+};
+
+/* Separates the threads of a DFA state that started at different offsets. */
+#define RE_MARK UINT32_MAX
+
+struct re_state {
+        struct re_state *next[256];
+        bool nl;
+        bool is_matched;
+        bool match;
+        bool match_nl;
+        bool is_dead;
+        bool is_special;
+        size_t n;
+        uint32_t set[];
+};
+
+struct dfa {
+        struct re_inst *prog;
+        size_t len;
+        bool is_unanchored;
+        bool uses_nl;
+        struct re_state *start[2];
+        struct re_state *skip;
+        uint8_t skip_until;
+        struct re_state **states;
+        size_t nstates;
+        struct re_state **table;
+        uint32_t *set;
+        uint32_t *tmp;
+        uint32_t *stack;
+        uint32_t *seen;
+        uint32_t gen;
+        bool is_flushed;
+};
+
+struct regex {
+        struct re_node *nodes;
+        size_t nnodes;
+        size_t capacity;
+        struct re_prog fwd;
+        struct re_prog rev;
+        struct dfa forward;
+        struct dfa backward;
+};
+
+struct re_parser {
+        struct regex *re;
+        const uint8_t *s;
+        const char *error;
+};
+
+static void set_add(uint8_t set[], uint8_t lo, uint8_t hi)
+{
+        for (unsigned c = lo; c <= hi; ++c)
+                set[c / 8] |= 1 << (c % 8);
+}
+
+static bool set_has(const uint8_t set[], uint8_t c)
+{
+        return set[c / 8] & (1 << (c % 8));
+}
+
+static size_t re_node(struct re_parser *p, int kind, size_t l, size_t r)
+{
+        struct regex *re = p->re;
+
+        if (l == SIZE_MAX || r == SIZE_MAX)
+                return SIZE_MAX;
+
+        if (re->nnodes == re->capacity) {
+                size_t capacity = re->capacity ? re->capacity * 2 : 64;
+                struct re_node *n = realloc(re->nodes, capacity * sizeof(*n));
+                if (!n) {
+                        p->error = "Out of memory.";
+                        return SIZE_MAX;
                 }
+                re->nodes = n;
+                re->capacity = capacity;
+        }
+
+        re->nodes[re->nnodes] = (struct re_node){.kind = kind, .l = l, .r = r};
+
+        return re->nnodes++;
+}
+
+static size_t re_range(struct re_parser *p, uint8_t lo, uint8_t hi)
+{
+        size_t n = re_node(p, RE_BYTES, 0, 0);
+
+        if (n != SIZE_MAX)
+                set_add(p->re->nodes[n].set, lo, hi);
+
+        return n;
+}
+
+/*
+  Any character of k bytes that starts with the first depth bytes of
+  the n characters in ex, other than those characters. Bytes that no
+  character in ex has at this depth are taken as a range, and each of
+  the others leads to the characters in ex that share it.
+*/
+static size_t re_tail_except(struct re_parser *p, size_t k, size_t depth, const uint8_t *ex[],
+                             size_t n)
+{
+        static const uint8_t lead[5][2] = {
+                [2] = {0xc0, 0xdf},
+                [3] = {0xe0, 0xef},
+                [4] = {0xf0, 0xf7},
+        };
+        size_t rest = depth ? re_range(p, 0x80, 0xbf) : re_range(p, lead[k][0], lead[k][1]);
+        size_t n_alt = SIZE_MAX;
+
+        if (rest == SIZE_MAX)
+                return SIZE_MAX;
+
+        for (size_t i = 0; i < n; ++i) {
+                uint8_t b = ex[i][depth];
+                uint8_t *set = p->re->nodes[rest].set;
+
+                if (!set_has(set, b))
+                        continue;
+                set[b / 8] &= ~(1 << (b % 8));
+
+                if (depth + 1 == k)
+                        continue;
+
+                size_t m = 0;
+                for (size_t j = i; j < n; ++j) {
+                        if (ex[j][depth] == b) {
+                                const uint8_t *t = ex[i + m];
+                                ex[i + m++] = ex[j];
+                                ex[j] = t;
+                        }
+                }
+
+                size_t t = re_node(p, RE_CAT, re_range(p, b, b),
+                                   re_tail_except(p, k, depth + 1, ex + i, m));
+                n_alt = n_alt == SIZE_MAX ? t : re_node(p, RE_ALT, n_alt, t);
+                if (n_alt == SIZE_MAX)
+                        return SIZE_MAX;
+        }
+
+        for (size_t d = depth + 1; d < k; ++d)
+                rest = re_node(p, RE_CAT, rest, re_range(p, 0x80, 0xbf));
+
+        return n_alt == SIZE_MAX ? rest : re_node(p, RE_ALT, rest, n_alt);
+}
+
+/* Any character of two or more bytes other than the n characters in ex. */
+static size_t re_multibyte_except(struct re_parser *p, const uint8_t *ex[], size_t n)
+{
+        size_t any = SIZE_MAX;
+
+        for (size_t k = 2; k <= 4; ++k) {
+                size_t m = 0;
+                for (size_t j = 0; j < n; ++j) {
+                        if (utf8_count(ex[j]) == k) {
+                                const uint8_t *t = ex[m];
+                                ex[m++] = ex[j];
+                                ex[j] = t;
+                        }
+                }
+
+                size_t t = re_tail_except(p, k, 0, ex, m);
+                any = any == SIZE_MAX ? t : re_node(p, RE_ALT, any, t);
+                if (any == SIZE_MAX)
+                        return SIZE_MAX;
 
-                ed.tl = p;
-                --ed.cursor_row;
+                ex += m;
+                n -= m;
         }
+
+        return any;
 }
 
-void forward_char()
+/* Any character of two or more bytes. */
+static size_t re_multibyte(struct re_parser *p)
 {
-        if (is_buffer_empty())
-                return;
-
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        const uint8_t *none[1];
 
-        ed.is_prefix = false;
-
-        while (repeat--) {
-                if (is_point_at_end_of_buffer())
-                        return;
-
-                struct tedchar *c = char_at_point();
+        return re_multibyte_except(p, none, 0);
+}
 
-                if (ed.cursor_row == ed.nlines - 1 && next_col(*c, ed.cursor_col) == 0) {
-                        scroll_up();
-                        c = char_at_point();
-                }
+/* The character at c, byte by byte. */
+static size_t re_char(struct re_parser *p, const uint8_t *c)
+{
+        size_t n = re_range(p, c[0], c[0]);
 
-                if (ed.cursor_row == 0 && ed.cursor_col == 0) {
-                        ed.tl = ed.gap_start;
-                }
+        for (size_t i = 1; i < utf8_count(c); ++i)
+                n = re_node(p, RE_CAT, n, re_range(p, c[i], c[i]));
 
-                *ed.gap_start = *c;
-                ++ed.gap_start;
-                ++ed.gap_end;
-                if (next_col(*c, ed.cursor_col) == 0) {
-                        ++ed.cursor_row;
-                }
-                ed.cursor_col = next_col(*c, ed.cursor_col);
+        return n;
+}
 
-                if (!ed.force_goal_col)
-                        ed.goal_col = ed.cursor_col;
+/* Add the class named by the escape c to set. */
+static bool re_class_escape(uint8_t set[], uint8_t c)
+{
+        switch (c) {
+        case 'd':
+                set_add(set, '0', '9');
+                return true;
+        case 'w':
+                set_add(set, '0', '9');
+                set_add(set, 'A', 'Z');
+                set_add(set, 'a', 'z');
+                set_add(set, '_', '_');
+                return true;
+        case 's':
+                set_add(set, '\t', '\r');
+                set_add(set, ' ', ' ');
+                return true;
+        default:
+                return false;
         }
 }
 
-void backward_char()
+static uint8_t re_escape(uint8_t c)
 {
-        if (is_buffer_empty())
-                return;
+        switch (c) {
+        case 'n':
+                return '\n';
+        case 't':
+                return '\t';
+        default:
+                return c;
+        }
+}
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+static size_t re_class(struct re_parser *p)
+{
+        uint8_t set[32] = {0};
+        const uint8_t *ex[QUERY_MAX];
+        size_t nex = 0;
+        size_t chars = SIZE_MAX;
+        bool negate = false;
 
-        ed.is_prefix = false;
+        if (*p->s == '^') {
+                negate = true;
+                ++p->s;
+        }
 
-        while (repeat--) {
-                if (is_point_at_beginning_of_buffer())
-                        return;
+        for (bool first = true; first || *p->s != ']'; first = false) {
+                const uint8_t *c = p->s;
+                uint8_t lo = *c;
 
-                if (ed.cursor_row == 0 && ed.cursor_col == 0) {
-                        scroll_down();
+                if (!*c) {
+                        p->error = "Unmatched [";
+                        return SIZE_MAX;
                 }
 
-                if (ed.gap_start > ed.buffer) {
-                        --ed.gap_end;
-                        --ed.gap_start;
-                        *ed.gap_end = *ed.gap_start;
-                        if (is_newline(*ed.gap_end) || ed.cursor_col == 0)
-                                --ed.cursor_row;
-                        ed.cursor_col = col_of(ed.gap_end);
+                if (*c == '\\' && c[1] && re_class_escape(set, c[1])) {
+                        p->s += 2;
+                        continue;
+                } else if (*c == '\\' && c[1] && c[1] < 0x80) {
+                        lo = re_escape(c[1]);
+                        p->s += 2;
+                } else {
+                        if (*c == '\\' && c[1])
+                                lo = *++c;
+                        p->s = c + utf8_count(c);
                 }
 
-                if (ed.cursor_row == 0 && ed.cursor_col == 0) {
-                        ed.tl = char_at_point();
-                }
+                if (*p->s == '-' && p->s[1] && p->s[1] != ']') {
+                        uint8_t hi = p->s[1];
 
-                if (!ed.force_goal_col)
-                        ed.goal_col = ed.cursor_col;
+                        if (lo >= 0x80 || hi >= 0x80 || hi < lo) {
+                                p->error = "Invalid range";
+                                return SIZE_MAX;
+                        }
+                        set_add(set, lo, hi);
+                        p->s += 2;
+                } else if (lo < 0x80) {
+                        set_add(set, lo, lo);
+                } else if (negate) {
+                        if (nex == QUERY_MAX) {
+                                p->error = "Class too long";
+                                return SIZE_MAX;
+                        }
+                        ex[nex++] = c;
+                } else {
+                        size_t n = re_char(p, c);
+                        if (n == SIZE_MAX)
+                                return SIZE_MAX;
+                        chars = chars == SIZE_MAX ? n : re_node(p, RE_ALT, chars, n);
+                }
+        }
+        ++p->s;
+
+        if (negate) {
+                for (size_t i = 0; i < 16; ++i)
+                        set[i] = ~set[i];
+                memset(set + 16, 0, 16);
+                set['\n' / 8] &= ~(1 << ('\n' % 8));
+                chars = re_multibyte_except(p, ex, nex);
         }
-}
 
-void forward_word()
-{
-        if (is_buffer_empty())
-                return;
+        size_t n = re_node(p, RE_BYTES, 0, 0);
+        if (n != SIZE_MAX)
+                memcpy(p->re->nodes[n].set, set, sizeof(set));
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        return chars == SIZE_MAX ? n : re_node(p, RE_ALT, n, chars);
+}
 
-        ed.is_prefix = false;
+static size_t re_alt(struct re_parser *p);
 
-        while (repeat--) {
-                if (is_point_at_end_of_buffer())
-                        return;
+static size_t re_atom(struct re_parser *p)
+{
+        const uint8_t *c = p->s;
+        size_t n;
 
-                while (!is_point_at_end_of_buffer() && is_whitespace(current_char()))
-                        forward_char();
+        switch (*c) {
+        case '(':
+                ++p->s;
+                n = re_alt(p);
+                if (n == SIZE_MAX)
+                        return n;
+                if (*p->s != ')') {
+                        p->error = "Unmatched (";
+                        return SIZE_MAX;
+                }
+                ++p->s;
+                return n;
+        case '[':
+                ++p->s;
+                return re_class(p);
+        case '.':
+                ++p->s;
+                n = re_range(p, 0x00, 0x7f);
+                if (n != SIZE_MAX)
+                        p->re->nodes[n].set['\n' / 8] &= ~(1 << ('\n' % 8));
+                return re_node(p, RE_ALT, n, re_multibyte(p));
+        case '^':
+                ++p->s;
+                return re_node(p, RE_BOL, 0, 0);
+        case '$':
+                ++p->s;
+                return re_node(p, RE_EOL, 0, 0);
+        case '*':
+        case '+':
+        case '?':
+                p->error = "Nothing to repeat";
+                return SIZE_MAX;
+        case '\\':
+                if (!c[1]) {
+                        p->error = "Trailing \\";
+                        return SIZE_MAX;
+                }
+                if (c[1] >= 0x80) {
+                        p->s = c + 1 + utf8_count(c + 1);
+                        return re_char(p, c + 1);
+                }
+                p->s += 2;
+                n = re_node(p, RE_BYTES, 0, 0);
+                if (n != SIZE_MAX && !re_class_escape(p->re->nodes[n].set, c[1]))
+                        set_add(p->re->nodes[n].set, re_escape(c[1]), re_escape(c[1]));
+                return n;
+        default:
+                p->s += utf8_count(c);
+                return re_char(p, c);
+        }
+}
 
-                while (!is_point_at_end_of_buffer() && !is_whitespace(current_char()))
-                        forward_char();
+static size_t re_repeat(struct re_parser *p)
+{
+        size_t n = re_atom(p);
+
+        while (1) {
+                switch (*p->s) {
+                case '*':
+                        n = re_node(p, RE_STAR, n, 0);
+                        break;
+                case '+':
+                        n = re_node(p, RE_PLUS, n, 0);
+                        break;
+                case '?':
+                        n = re_node(p, RE_QUEST, n, 0);
+                        break;
+                default:
+                        return n;
+                }
+                ++p->s;
         }
 }
 
-bool is_point_at_beginning_of_word()
+static size_t re_cat(struct re_parser *p)
 {
-        if (is_buffer_empty())
-                return false;
+        size_t n = re_node(p, RE_EMPTY, 0, 0);
 
-        if (is_point_at_end_of_buffer())
-                return false;
+        while (n != SIZE_MAX && *p->s && *p->s != '|' && *p->s != ')')
+                n = re_node(p, RE_CAT, n, re_repeat(p));
 
-        struct tedchar *p = char_at_point();
+        return n;
+}
 
-        if (is_point_at_beginning_of_buffer())
-                return !is_whitespace(*p);
+static size_t re_alt(struct re_parser *p)
+{
+        size_t n = re_cat(p);
 
-        struct tedchar *q = retreat(p);
+        while (n != SIZE_MAX && *p->s == '|') {
+                ++p->s;
+                n = re_node(p, RE_ALT, n, re_cat(p));
+        }
 
-        return !is_whitespace(*p) && is_whitespace(*q);
+        return n;
 }
 
-void backward_word()
+static bool re_nullable(struct regex *re, size_t n)
 {
-        if (is_buffer_empty())
-                return;
+        struct re_node *x = &re->nodes[n];
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        switch (x->kind) {
+        case RE_BYTES:
+                return false;
+        case RE_CAT:
+                return re_nullable(re, x->l) && re_nullable(re, x->r);
+        case RE_ALT:
+                return re_nullable(re, x->l) || re_nullable(re, x->r);
+        case RE_PLUS:
+                return re_nullable(re, x->l);
+        default:
+                return true;
+        }
+}
 
-        ed.is_prefix = false;
+static size_t re_emit(struct re_prog *prog, int op)
+{
+        if (prog->len == prog->capacity) {
+                size_t capacity = prog->capacity ? prog->capacity * 2 : 64;
+                struct re_inst *i = realloc(prog->inst, capacity * sizeof(*i));
+                if (!i)
+                        return SIZE_MAX;
+                prog->inst = i;
+                prog->capacity = capacity;
+        }
 
-        while (repeat--) {
-                if (is_point_at_beginning_of_word() || is_point_at_end_of_buffer())
-                        backward_char();
+        prog->inst[prog->len] = (struct re_inst){.op = op};
 
-                while (is_whitespace(current_char())) {
-                        backward_char();
-                        if (is_point_at_beginning_of_buffer())
-                                return;
-                }
+        return prog->len++;
+}
 
-                while (!is_whitespace(current_char())) {
-                        backward_char();
-                        if (is_point_at_beginning_of_buffer())
-                                return;
-                }
+/* Compile node n into prog, with concatenations reversed if reverse. */
+static bool re_compile_node(struct regex *re, struct re_prog *prog, size_t n, bool reverse)
+{
+        struct re_node x = re->nodes[n];
+        size_t i, j;
 
-                forward_char();
+        switch (x.kind) {
+        case RE_EMPTY:
+                return true;
+        case RE_BYTES:
+                if ((i = re_emit(prog, OP_BYTES)) == SIZE_MAX)
+                        return false;
+                memcpy(prog->inst[i].set, x.set, sizeof(x.set));
+                return true;
+        case RE_CAT:
+                if (reverse)
+                        return re_compile_node(re, prog, x.r, reverse) &&
+                               re_compile_node(re, prog, x.l, reverse);
+                return re_compile_node(re, prog, x.l, reverse) &&
+                       re_compile_node(re, prog, x.r, reverse);
+        case RE_ALT:
+                if ((i = re_emit(prog, OP_SPLIT)) == SIZE_MAX)
+                        return false;
+                prog->inst[i].x = i + 1;
+                if (!re_compile_node(re, prog, x.l, reverse))
+                        return false;
+                if ((j = re_emit(prog, OP_JMP)) == SIZE_MAX)
+                        return false;
+                prog->inst[i].y = j + 1;
+                if (!re_compile_node(re, prog, x.r, reverse))
+                        return false;
+                prog->inst[j].x = prog->len;
+                return true;
+        case RE_STAR:
+                if ((i = re_emit(prog, OP_SPLIT)) == SIZE_MAX)
+                        return false;
+                prog->inst[i].x = i + 1;
+                if (!re_compile_node(re, prog, x.l, reverse))
+                        return false;
+                if ((j = re_emit(prog, OP_JMP)) == SIZE_MAX)
+                        return false;
+                prog->inst[j].x = i;
+                prog->inst[i].y = prog->len;
+                return true;
+        case RE_PLUS:
+                i = prog->len;
+                if (!re_compile_node(re, prog, x.l, reverse))
+                        return false;
+                if ((j = re_emit(prog, OP_SPLIT)) == SIZE_MAX)
+                        return false;
+                prog->inst[j].x = i;
+                prog->inst[j].y = prog->len;
+                return true;
+        case RE_QUEST:
+                if ((i = re_emit(prog, OP_SPLIT)) == SIZE_MAX)
+                        return false;
+                prog->inst[i].x = i + 1;
+                if (!re_compile_node(re, prog, x.l, reverse))
+                        return false;
+                prog->inst[i].y = prog->len;
+                return true;
+        case RE_BOL:
+                return re_emit(prog, reverse ? OP_BEFORE_NL : OP_AFTER_NL) != SIZE_MAX;
+        case RE_EOL:
+                return re_emit(prog, reverse ? OP_AFTER_NL : OP_BEFORE_NL) != SIZE_MAX;
+        default:
+                unreachable();
         }
 }
 
-void forward_paragraph()
+static bool dfa_init(struct dfa *d, struct re_prog *prog, bool is_unanchored)
 {
-        if (is_buffer_empty())
-                return;
-
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
-
-        ed.is_prefix = false;
+        size_t len = prog->len;
 
-        while (repeat--) {
-                if (is_point_at_end_of_buffer())
-                        return;
+        *d = (struct dfa){.prog = prog->inst, .len = len, .is_unanchored = is_unanchored};
 
-                while (!is_point_at_end_of_buffer() && is_whitespace(current_char()))
-                        forward_char();
+        d->states = malloc(RE_STATES_MAX * sizeof(*d->states));
+        d->table = calloc(2 * RE_STATES_MAX, sizeof(*d->table));
+        d->set = malloc((2 * len + 1) * sizeof(*d->set));
+        d->tmp = malloc((2 * len + 1) * sizeof(*d->tmp));
+        d->stack = malloc((2 * len + 1) * sizeof(*d->stack));
+        d->seen = calloc(len, sizeof(*d->seen));
 
-                size_t newline_run = 0;
-                while (!is_point_at_end_of_buffer()) {
-                        if (is_newline(current_char())) {
-                                ++newline_run;
-                                if (newline_run == 2)
-                                        break;
-                        } else {
-                                newline_run = 0;
-                        }
+        for (size_t i = 0; i < len; ++i)
+                d->uses_nl |= prog->inst[i].op == OP_AFTER_NL;
 
-                        forward_char();
-                }
-        }
+        return d->states && d->table && d->set && d->tmp && d->stack && d->seen;
 }
 
-void backward_paragraph()
+static void dfa_flush(struct dfa *d)
 {
-        if (is_buffer_empty())
-                return;
+        for (size_t i = 0; i < d->nstates; ++i)
+                free(d->states[i]);
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        d->nstates = 0;
+        memset(d->table, 0, 2 * RE_STATES_MAX * sizeof(*d->table));
+        d->start[0] = d->start[1] = NULL;
+        d->skip = NULL;
+        d->is_flushed = true;
+}
 
-        ed.is_prefix = false;
+static void dfa_free(struct dfa *d)
+{
+        for (size_t i = 0; i < d->nstates; ++i)
+                free(d->states[i]);
 
-        while (repeat--) {
-                if (is_point_at_beginning_of_buffer())
-                        return;
+        free(d->states);
+        free(d->table);
+        free(d->set);
+        free(d->tmp);
+        free(d->stack);
+        free(d->seen);
+}
 
-                backward_char();
+static void dfa_next_gen(struct dfa *d)
+{
+        if (!++d->gen) {
+                memset(d->seen, 0, d->len * sizeof(*d->seen));
+                d->gen = 1;
+        }
+}
 
-                while (!is_point_at_beginning_of_buffer() && is_whitespace(current_char()))
-                        backward_char();
+/*
+  Add pc, and everything reachable from it without reading a byte, to
+  set. nl says whether the last byte read was a newline and eol whether
+  the next one is. If it is not known whether the next byte is a
+  newline, the instructions that ask are kept in the set.
+*/
+static void dfa_add(struct dfa *d, size_t pc, bool nl, bool eol, uint32_t *set, size_t *n)
+{
+        size_t top = 0;
 
-                size_t newline_run = 0;
-                while (!is_point_at_beginning_of_buffer()) {
-                        if (is_newline(current_char())) {
-                                ++newline_run;
-                                if (newline_run == 2) {
-                                        while (!is_point_at_end_of_buffer() &&
-                                               is_whitespace(current_char()))
-                                                forward_char();
-                                        break;
-                                }
-                        } else {
-                                newline_run = 0;
-                        }
+        d->stack[top++] = pc;
+        while (top) {
+                pc = d->stack[--top];
+                if (d->seen[pc] == d->gen)
+                        continue;
+                d->seen[pc] = d->gen;
 
-                        backward_char();
+                struct re_inst *i = &d->prog[pc];
+                switch (i->op) {
+                case OP_JMP:
+                        d->stack[top++] = i->x;
+                        break;
+                case OP_SPLIT:
+                        d->stack[top++] = i->y;
+                        d->stack[top++] = i->x;
+                        break;
+                case OP_AFTER_NL:
+                        if (nl)
+                                d->stack[top++] = pc + 1;
+                        break;
+                case OP_BEFORE_NL:
+                        set[(*n)++] = pc;
+                        if (eol)
+                                d->stack[top++] = pc + 1;
+                        break;
+                default:
+                        set[(*n)++] = pc;
                 }
         }
 }
 
-void next_row()
+static void dfa_add_mark(uint32_t *set, size_t *n)
 {
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
-
-        ed.is_prefix = false;
+        if (*n && set[*n - 1] != RE_MARK)
+                set[(*n)++] = RE_MARK;
+}
 
-        while (repeat--) {
-                if (ed.cursor_row == ed.nlines - 1) {
-                        scroll_up();
-                }
+/*
+  Put in to the threads of from that are left once the next byte is
+  known to be a newline.
+*/
+static size_t dfa_eol(struct dfa *d, const uint32_t *from, size_t k, bool nl, uint32_t *to)
+{
+        size_t n = 0;
 
-                size_t save_goal = ed.goal_col;
+        dfa_next_gen(d);
+        for (size_t i = 0; i < k; ++i) {
+                if (from[i] == RE_MARK)
+                        dfa_add_mark(to, &n);
+                else
+                        dfa_add(d, from[i], nl, true, to, &n);
+        }
 
-                end_of_row();
-                forward_char();
-                beginning_of_row();
+        if (n && to[n - 1] == RE_MARK)
+                --n;
 
-                while (1) {
-                        struct tedchar *p = char_at_point();
-                        if (ed.cursor_col >= save_goal || !p || is_newline(*p)) {
-                                ed.goal_col = save_goal;
-                                break;
-                        }
-                        forward_char();
-                }
-        }
+        return n;
 }
 
-void previous_row()
+/* Find or make the state for the n entries of set. */
+static struct re_state *dfa_state(struct dfa *d, uint32_t *set, size_t n, bool nl, bool is_matched)
 {
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
-
-        ed.is_prefix = false;
+        size_t mask = 2 * RE_STATES_MAX - 1;
+        size_t hash = nl * 2 + is_matched;
+        size_t h;
 
-        while (repeat--) {
-                if (ed.cursor_row == 0) {
-                        scroll_down();
-                }
+        for (size_t i = 0; i < n; ++i)
+                hash = hash * 31 + set[i];
 
-                size_t save_goal = ed.goal_col;
+        for (h = hash & mask; d->table[h]; h = (h + 1) & mask) {
+                struct re_state *s = d->table[h];
+                if (s->nl == nl && s->is_matched == is_matched && s->n == n &&
+                    !memcmp(s->set, set, n * sizeof(*set)))
+                        return s;
+        }
 
-                beginning_of_row();
-                backward_char();
-                beginning_of_row();
+        if (d->nstates == RE_STATES_MAX) {
+                dfa_flush(d);
+                h = hash & mask;
+        }
 
-                while (1) {
-                        struct tedchar *p = char_at_point();
+        struct re_state *s = malloc(sizeof(*s) + n * sizeof(*set));
+        if (!s)
+                return NULL;
 
-                        if (ed.cursor_col >= save_goal || !p || is_newline(*p)) {
-                                ed.goal_col = save_goal;
-                                break;
-                        }
+        memset(s->next, 0, sizeof(s->next));
+        s->nl = nl;
+        s->is_matched = is_matched;
+        s->n = n;
+        memcpy(s->set, set, n * sizeof(*set));
 
-                        forward_char();
-                }
-        }
-}
+        size_t m = dfa_eol(d, set, n, nl, d->tmp);
 
-void beginning_of_row()
-{
-        while (ed.cursor_col > 0)
-                backward_char();
+        s->match = s->match_nl = false;
+        for (size_t i = 0; i < n; ++i)
+                s->match |= set[i] != RE_MARK && d->prog[set[i]].op == OP_MATCH;
+        for (size_t i = 0; i < m; ++i)
+                s->match_nl |= d->tmp[i] != RE_MARK && d->prog[d->tmp[i]].op == OP_MATCH;
+        s->is_dead = !n && (is_matched || !d->is_unanchored);
+        s->is_special = s->match_nl || s->is_dead;
 
-        if (!ed.force_goal_col)
-                ed.goal_col = 0;
+        d->states[d->nstates++] = s;
+        d->table[h] = s;
+
+        return s;
 }
 
-void end_of_row()
+static struct re_state *dfa_start(struct dfa *d, bool nl)
 {
-        struct tedchar *p = char_at_point();
-        while (p) {
-                size_t n = next_col(*p, ed.cursor_col);
-                if (n == 0)
-                        break;
-                forward_char();
-                p = char_at_point();
+        nl = nl && d->uses_nl;
+        if (!d->start[nl]) {
+                size_t n = 0;
+                dfa_next_gen(d);
+                dfa_add(d, 0, nl, false, d->set, &n);
+                d->start[nl] = dfa_state(d, d->set, n, nl, false);
         }
+
+        return d->start[nl];
 }
 
-void beginning_of_line()
+/*
+  The threads of a state are kept in the order they started. Once one
+  of them has matched, the ones that started later can no longer give
+  the leftmost match and are dropped, and no new ones are started.
+*/
+static struct re_state *dfa_step(struct dfa *d, struct re_state *s, uint8_t b)
 {
-        if (is_buffer_empty())
-                return;
+        const uint32_t *from = s->set;
+        size_t k = s->n;
+        size_t n = 0;
+        bool is_matched = s->is_matched;
+        bool nl = b == '\n' && d->uses_nl;
 
-        if (char_at_point() && is_newline(current_char()))
-                backward_char();
+        if (b == '\n') {
+                k = dfa_eol(d, s->set, s->n, s->nl, d->tmp);
+                from = d->tmp;
+        }
 
-        while (1) {
-                if (is_point_at_beginning_of_buffer())
-                        return;
+        for (size_t i = 0; i < k; ++i) {
+                if (from[i] != RE_MARK && d->prog[from[i]].op == OP_MATCH) {
+                        while (i < k && from[i] != RE_MARK)
+                                ++i;
+                        k = i;
+                        is_matched = true;
+                }
+        }
 
-                if (char_at_point() && is_newline(current_char())) {
-                        forward_char();
-                        return;
+        dfa_next_gen(d);
+        for (size_t i = 0; i < k; ++i) {
+                if (from[i] == RE_MARK) {
+                        dfa_add_mark(d->set, &n);
+                        continue;
                 }
 
-                backward_char();
+                struct re_inst *inst = &d->prog[from[i]];
+                if (inst->op == OP_BYTES && set_has(inst->set, b))
+                        dfa_add(d, from[i] + 1, nl, false, d->set, &n);
         }
-}
 
-void end_of_line()
-{
-        if (is_buffer_empty())
-                return;
+        if (d->is_unanchored && !is_matched) {
+                dfa_add_mark(d->set, &n);
+                dfa_add(d, 0, nl, false, d->set, &n);
+        }
 
-        while (!is_point_at_end_of_buffer() && !is_newline(current_char()))
-                forward_char();
+        if (n && d->set[n - 1] == RE_MARK)
+                --n;
+
+        d->is_flushed = false;
+        struct re_state *t = dfa_state(d, d->set, n, nl, is_matched);
+        if (t && !d->is_flushed)
+                s->next[b] = t;
+
+        return t;
 }
 
-void goto_line()
+static struct re_state *dfa_next(struct dfa *d, struct re_state *s, uint8_t b)
 {
-        size_t line_no = ed.prefix_arg;
+        return s->next[b] ? s->next[b] : dfa_step(d, s, b);
+}
 
-        if (!ed.is_prefix || ed.prefix_arg < 1)
-                line_no = 1;
+/*
+  If only one byte leads out of the start state, as when the pattern
+  begins with a literal, the search can skip to it with memchr.
+*/
+static bool dfa_find_skip(struct dfa *d)
+{
+        struct re_state *s = dfa_start(d, false);
+        size_t n = 0;
 
-        ed.is_prefix = false;
+        if (!s)
+                return false;
 
-        beginning_of_buffer();
-        while (--line_no) {
-                end_of_line();
-                forward_char();
+        d->is_flushed = false;
+        for (size_t b = 0; b < 256; ++b) {
+                struct re_state *t = dfa_next(d, s, b);
+                if (!t)
+                        return false;
+                if (d->is_flushed)
+                        return true;
+                if (t != s) {
+                        d->skip_until = b;
+                        ++n;
+                }
         }
+
+        if (n == 1)
+                d->skip = s;
+
+        return true;
 }
 
-void move_to(size_t n)
+static void re_free(struct regex *re)
 {
-        beginning_of_buffer();
-        while (n--)
-                forward_char();
+        free(re->nodes);
+        free(re->fwd.inst);
+        free(re->rev.inst);
+        dfa_free(&re->forward);
+        dfa_free(&re->backward);
 }
 
-void goto_percent()
+/*
+  Compile pattern into re. On failure, error says why and re holds
+  nothing that needs freeing.
+*/
+static bool re_compile(struct regex *re, const uint8_t *pattern, const char **error)
 {
-        size_t percent = ed.prefix_arg;
+        struct re_parser p = {.re = re, .s = pattern, .error = "Out of memory."};
 
-        if (!ed.is_prefix || ed.prefix_arg < 0)
-                percent = 0;
-        else if (ed.prefix_arg > 100)
-                percent = 100;
+        *re = (struct regex){0};
 
-        move_to((buffer_size() * percent) / 100);
+        size_t n = re_alt(&p);
+        if (n != SIZE_MAX && *p.s) {
+                p.error = "Unmatched )";
+                n = SIZE_MAX;
+        }
+        if (n != SIZE_MAX && re_nullable(re, n)) {
+                p.error = "Pattern matches empty text";
+                n = SIZE_MAX;
+        }
+        *error = p.error;
+
+        if (n == SIZE_MAX || !re_compile_node(re, &re->fwd, n, false) ||
+            re_emit(&re->fwd, OP_MATCH) == SIZE_MAX || !re_compile_node(re, &re->rev, n, true) ||
+            re_emit(&re->rev, OP_MATCH) == SIZE_MAX)
+                goto err;
+
+        if (!dfa_init(&re->forward, &re->fwd, true) || !dfa_init(&re->backward, &re->rev, false) ||
+            !dfa_find_skip(&re->forward))
+                goto err;
+
+        free(re->nodes);
+        re->nodes = NULL;
+
+        return true;
+err:
+        re_free(re);
+        return false;
 }
 
-void beginning_of_buffer()
+static bool is_bol(size_t off)
 {
-        while (ed.gap_start > ed.buffer)
-                backward_char();
+        return !off || *pointer_at(off - 1) == '\n';
 }
 
-void end_of_buffer()
+static bool is_eol(size_t off)
 {
-        while (char_at_point())
-                forward_char();
+        return off == text_size() || *pointer_at(off) == '\n';
 }
 
-void page_down()
+/*
+  Run the forward DFA of re from state s over the text in [from, to),
+  and put in end the offset after the last byte where a match ended.
+  Returns the state it stopped in, which is dead if no match can go on,
+  or NULL if out of memory.
+*/
+static struct re_state *re_scan(struct regex *re, struct re_state *s, size_t from, size_t to,
+                                size_t *end)
 {
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        struct spans it = spans(from, to);
+        uint8_t *p;
+        size_t n;
 
-        ed.is_prefix = false;
+        while (next_span(&it, &p, &n)) {
+                size_t base = it.from - n;
 
-        while (repeat--) {
-                for (size_t i = 0; i < (ed.nlines + 2) / 2; ++i) {
-                        scroll_up();
-                        next_row();
+                for (size_t i = 0; i < n; ++i) {
+                        if (s == re->forward.skip) {
+                                uint8_t *q = memchr(p + i, re->forward.skip_until, n - i);
+                                if (!q)
+                                        break;
+                                i = q - p;
+                        }
+                        if (!(s = dfa_next(&re->forward, s, p[i])))
+                                return NULL;
+                        if (!s->is_special)
+                                continue;
+                        if (s->is_dead)
+                                return s;
+                        if (s->match || is_eol(base + i + 1))
+                                *end = base + i + 1;
                 }
         }
+
+        return s;
 }
 
-void page_up()
+/*
+  Find the leftmost-longest match that starts in [from, limit) and put
+  its bounds in start and end, or set start to SIZE_MAX if there is
+  none. The forward DFA finds where the match ends, then the backward
+  DFA finds where it starts. Past limit, the forward DFA starts no new
+  threads, so it stops as soon as the ones already running die, or at
+  offset to, past which matches are cut short. Returns false if out of
+  memory.
+*/
+static bool re_find(struct regex *re, size_t from, size_t limit, size_t to, size_t *start,
+                    size_t *end)
 {
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        struct dfa *d = &re->forward;
+        size_t size = min(to, text_size());
+        struct re_state *s;
 
-        ed.is_prefix = false;
+        *start = *end = SIZE_MAX;
+        if (from >= min(limit, size))
+                return true;
 
-        while (repeat--) {
-                for (size_t i = 0; i < (ed.nlines + 2) / 2; ++i) {
-                        scroll_down();
-                        previous_row();
-                }
-        }
-}
+        /* No thread is started at limit or after it. */
+        size_t last = limit < size ? limit - 1 : size;
 
-void set_goal_column()
-{
-        if (ed.is_prefix) {
-                ed.force_goal_col = false;
-        } else {
-                ed.force_goal_col = true;
-                ed.goal_col = ed.cursor_col;
+        if (!(s = dfa_start(d, is_bol(from))) || !(s = re_scan(re, s, from, last, end)))
+                return false;
+
+        if (!s->is_dead && last < size) {
+                memcpy(d->set, s->set, s->n * sizeof(*s->set));
+                if (!(s = dfa_state(d, d->set, s->n, s->nl, true)))
+                        return false;
+                if (!s->is_dead && !re_scan(re, s, last, size, end))
+                        return false;
         }
-}
 
-bool is_textchar(struct key k)
-{
-        if (key_eq(k, kbd("<cr>")) || key_eq(k, kbd("<tab>")))
+        if (*end == SIZE_MAX)
                 return true;
 
-        if (k.special)
-                return false;
-
-        if (k.ctrl || k.meta || k.super || k.shift)
+        if (!(s = dfa_start(&re->backward, is_eol(*end))))
                 return false;
 
-        if (utf8_count(k.u.c) == 1)
-                return 0x20 <= k.u.c[0] && k.u.c[0] <= 0x7e;
+        for (size_t i = *end;; --i) {
+                if (s->match_nl && (s->match || is_bol(i)))
+                        *start = i;
+                if (i == from)
+                        break;
+                if (!(s = dfa_next(&re->backward, s, *pointer_at(i - 1))))
+                        return false;
+                if (s->is_dead)
+                        break;
+        }
 
         return true;
 }
 
-void do_insert_char(struct tedchar t)
+/*
+  Find the last match that starts before offset before. Matches can
+  only be found going forward, so the text is searched in windows that
+  begin at the start of a line and double in size going back, until
+  one of them holds a match.
+*/
+static bool re_find_before(struct regex *re, size_t before, size_t *start, size_t *end)
 {
-        ed.is_dirty = true;
+        size_t w = BLKSIZE;
 
-        size_t p = where();
+        *start = *end = SIZE_MAX;
 
-        if (ed.gap_start < ed.gap_end) {
-                *ed.gap_start = t;
-                if (ed.cursor_row == 0 && ed.cursor_col == 0)
-                        ed.tl = ed.gap_start;
-                ++ed.gap_start;
-                size_t new_col = next_col(t, ed.cursor_col);
-                if (new_col == 0) {
-                        if (ed.cursor_row == ed.nlines - 1)
-                                scroll_up();
-                        ++ed.cursor_row;
+        for (size_t hi = before; hi && *start == SIZE_MAX; w *= 2) {
+                size_t lo = line_start_of(hi > w ? hi - w : 0);
+                size_t s, e;
+
+                for (size_t from = lo;; from = e) {
+                        if (!re_find(re, from, hi, SIZE_MAX, &s, &e))
+                                return false;
+                        if (s == SIZE_MAX)
+                                break;
+                        *start = s;
+                        *end = e;
                 }
-                ed.cursor_col = new_col;
-                if (!ed.force_goal_col)
-                        ed.goal_col = ed.cursor_col;
-        } else {
-                unreachable(); // TODO: Re-allocate or save and quit.
+
+                hi = lo;
         }
 
-        update_marks_after_insert(p);
+        return true;
 }
 
-void insert_char()
-{
-        struct key k = ed.last_key;
-
-        assert(is_textchar(k));
+/*
+  Search results are not kept. Instead, the next or previous match is
+  found from point when it is needed, so any number of matches takes
+  the same memory. Only the results of TED_SEARCH are kept as a list.
 
-        guard(!ed.is_read_only);
+  Put the bounds of the first match that starts in [from, limit) in
+  start and end, or set start to SIZE_MAX if there is none. Returns
+  false if out of memory.
+*/
+static bool find_match(size_t from, size_t limit, size_t *start, size_t *end)
+{
+        if (ed.search.kind == SEARCH_REGEX)
+                return re_find(ed.search.re, from, limit, SIZE_MAX, start, end);
 
-        struct tedchar t;
+        *start = find_literal(from, limit);
+        *end = *start == SIZE_MAX ? SIZE_MAX : *start + ed.search.len;
 
-        if (key_eq(k, kbd("<cr>")))
-                t = tedchar_newline();
-        else if (key_eq(k, kbd("<tab>")))
-                t = tedchar_utf8(utf8_ascii('\t'));
-        else
-                t = tedchar_utf8(k.u);
+        return true;
+}
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+/* Like find_match, for the last match that starts before offset before. */
+static bool find_match_before(size_t before, size_t *start, size_t *end)
+{
+        if (ed.search.kind == SEARCH_REGEX)
+                return re_find_before(ed.search.re, before, start, end);
 
-        ed.is_prefix = false;
+        *start = find_literal_before(before);
+        *end = *start == SIZE_MAX ? SIZE_MAX : *start + ed.search.len;
 
-        while (repeat--) {
-                do_insert_char(t);
-        }
+        return true;
 }
 
-void open_line()
+static void find_visible_matches(size_t from, size_t to)
 {
-        guard(!ed.is_read_only);
+        size_t start, end;
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        frame_matches.len = 0;
 
-        ed.is_prefix = false;
+        if (ed.search.kind == SEARCH_LITERAL && ed.search.len)
+                from = from < ed.search.len ? 0 : from - (ed.search.len - 1);
+        else if (ed.search.kind != SEARCH_REGEX)
+                return;
 
-        while (repeat--) {
-                do_insert_char(tedchar_newline());
-                backward_char();
-        }
-}
+        for (;;) {
+                size_t k = frame_matches.len;
 
-void open_next_line()
-{
-        guard(!ed.is_read_only);
+                if (ed.search.kind == SEARCH_REGEX) {
+                        if (!re_find(ed.search.re, from, to, to, &start, &end))
+                                return;
+                } else {
+                        start = find_literal(from, to);
+                        end = start + ed.search.len;
+                }
+                if (start == SIZE_MAX)
+                        return;
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+                if (k && start <= frame_matches.m[k - 1].end) {
+                        frame_matches.m[k - 1].end = end;
+                } else if (k < MATCHES_MAX) {
+                        frame_matches.m[k].start = start;
+                        frame_matches.m[k].end = end;
+                        ++frame_matches.len;
+                } else {
+                        return;
+                }
 
-        ed.is_prefix = false;
+                from = ed.search.kind == SEARCH_REGEX ? end : start + 1;
+        }
+}
 
-        while (repeat--) {
-                end_of_line();
-                do_insert_char(tedchar_newline());
+/*
+  Find the first match at or after off, or the last one before it if
+  backward, wrapping around at the ends.
+*/
+static bool first_match(size_t off, bool backward, size_t *start, size_t *end)
+{
+        if (backward) {
+                if (!find_match_before(off, start, end))
+                        return false;
+                return *start != SIZE_MAX || find_match_before(text_size(), start, end);
         }
+
+        if (!find_match(off, SIZE_MAX, start, end))
+                return false;
+        return *start != SIZE_MAX || find_match(0, off, start, end);
 }
 
-static void copy_indent_of_line(struct tedchar *indent, size_t *i)
+static void goto_match(size_t start, size_t end)
 {
-        size_t save = where();
+        ed.search.start = start;
+        ed.search.end = end;
+        move_to_offset(start);
+}
 
-        beginning_of_line();
-        *i = 0;
-        while (!is_point_at_end_of_buffer() &&
-               (is_space(current_char()) || is_tab(current_char()))) {
-                indent[(*i)++] = current_char();
-                forward_char();
+void search_quit()
+{
+        if (ed.search.re) {
+                re_free(ed.search.re);
+                free(ed.search.re);
+                ed.search.re = NULL;
         }
 
-        move_to(save);
+        ed.search.kind = SEARCH_NONE;
+        ed.search.last = 0;
 }
 
-void newline_and_indent()
+/*
+  Where to look for the next match: past the one at point, or at point
+  if it has moved away. Literal matches may overlap, regex matches do
+  not.
+*/
+static size_t next_match_from()
 {
-        guard(!ed.is_read_only);
+        size_t point = ed.gap_start - ed.buffer;
 
-        struct tedchar indent[LINE_MAX + 1];
-        size_t i = 0;
-
-        copy_indent_of_line(indent, &i);
+        if (point != ed.search.start)
+                return point;
 
-        do_insert_char(tedchar_newline());
-        for (size_t j = 0; j < i; ++j)
-                do_insert_char(indent[j]);
+        return ed.search.kind == SEARCH_REGEX ? ed.search.end : point + 1;
 }
 
-void indent_current_line()
+void search_previous()
 {
-        guard(!ed.is_read_only);
+        size_t point = ed.gap_start - ed.buffer;
+        size_t start, end;
 
-        size_t original = new_temp_mark();
+        if (ed.search.kind == SEARCH_NONE) {
+                isearch(true);
+                return;
+        }
 
-        beginning_of_line();
-        size_t line_start = new_temp_mark();
+        if (ed.search.kind == SEARCH_LIST) {
+                if (ed.search.current == 0) {
+                        echo_info_preserve("Wrapped backward search");
+                        goto_search_result(ed.search.last - 1);
+                } else {
+                        goto_search_result(ed.search.current - 1);
+                }
+                return;
+        }
 
-        backward_char();
+        if (!first_match(point, true, &start, &end)) {
+                echo_error("Out of memory.");
+        } else if (start == SIZE_MAX) {
+                echo_info_preserve("No results");
+        } else {
+                if (start >= point)
+                        echo_info_preserve("Wrapped backward search");
+                goto_match(start, end);
+        }
+}
 
-        move_to(position_of_temp_mark(line_start));
-        for (size_t j = 0; j < ed.options.indent.len; ++j)
-                do_insert_char(ed.options.indent.c[j]);
-        move_to(position_of_temp_mark(original));
+void search_next()
+{
+        size_t from = next_match_from();
+        size_t start, end;
 
-        free_temp_mark(line_start);
-        free_temp_mark(original);
-}
+        if (ed.search.kind == SEARCH_NONE)
+                return;
+
+        if (ed.search.kind == SEARCH_LIST) {
+                if (ed.search.current + 1 == ed.search.last) {
+                        echo_info_preserve("Wrapped search");
+                        goto_search_result(0);
+                } else {
+                        goto_search_result(ed.search.current + 1);
+                }
+                return;
+        }
 
-static bool point_matches(struct tedchar *s, size_t len)
-{
-        size_t j = where();
-        for (size_t i = 0; i < len; ++i) {
-                struct tedchar *cj = char_at_index(j);
-                if (!cj)
-                        return false;
-                if (!tedchar_eq(s[i], *cj))
-                        return false;
+        if (!first_match(from, false, &start, &end)) {
+                echo_error("Out of memory.");
+        } else if (start == SIZE_MAX) {
+                echo_info_preserve("No results");
+        } else {
+                if (start < from)
+                        echo_info_preserve("Wrapped search");
+                goto_match(start, end);
         }
-        return true;
 }
 
-void open_previous_line()
+/*
+  Count the matches, and how many of them start before point. The count
+  gives up and returns false as soon as a key is waiting, so that
+  counting a large buffer never holds up typing. Literal matches are
+  counted on several threads that all stop when a key arrives, and
+  regex matches one at a time. Also returns false if out of memory.
+*/
+static bool count_matches(size_t *n, size_t *before)
 {
-        guard(!ed.is_read_only);
+        size_t point = ed.gap_start - ed.buffer;
+        size_t start, end;
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        *n = *before = 0;
 
-        ed.is_prefix = false;
+        if (ed.search.kind == SEARCH_LITERAL) {
+                if (key_pending())
+                        return false;
+                return count_literal(n, before);
+        }
 
-        while (repeat--) {
-                beginning_of_line();
-                open_line();
+        for (size_t from = 0;; from = end) {
+                if (!(*n % 1024) && key_pending())
+                        return false;
+                if (!find_match(from, SIZE_MAX, &start, &end))
+                        return false;
+                if (start == SIZE_MAX)
+                        return true;
+                ++*n;
+                *before += start < point;
         }
 }
 
-void delete_char()
+/* Append the character typed as k to the n byte buffer buf of length len. */
+static void append_key(uint8_t buf[], size_t *len, size_t n, struct key k)
 {
-        guard(!ed.is_read_only);
+        struct tedchar t = tedchar_utf8(k.u);
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        if (key_eq(k, kbd("<tab>")))
+                t = tedchar_utf8(utf8_ascii('\t'));
 
-        ed.is_prefix = false;
+        if (*len + utf8_count(t.u.c) < n) {
+                *len += tedchar_to_bytes(buf + *len, t);
+                buf[*len] = 0;
+        }
+}
 
-        while (repeat--) {
-                if (is_buffer_empty() || is_point_at_end_of_buffer())
-                        return;
+/*
+  Read a line of text in the echo area. Returns false if cancelled
+  with C-g.
+*/
+static bool read_string(const char *prompt, uint8_t buf[], size_t n)
+{
+        size_t len = 0;
 
-                ed.is_dirty = true;
+        buf[0] = 0;
 
-                size_t p = where();
+        while (1) {
+                echo_info("%s%s", prompt, buf);
 
-                if (ed.cursor_row == ed.nlines - 1 && next_col(current_char(), ed.cursor_col) == 0)
-                        scroll_up();
+                struct key k = read_key();
 
-                if (ed.tl == ed.gap_end) {
-                        ed.tl = advance(ed.gap_end);
+                if (key_eq(k, kbd("C-g"))) {
+                        echo_clear();
+                        return false;
+                } else if (key_eq(k, kbd("<cr>"))) {
+                        echo_clear();
+                        return true;
+                } else if (key_eq(k, kbd("<backspace>"))) {
+                        while (len && is_continuation_byte(buf[--len]))
+                                ;
+                        buf[len] = 0;
+                } else if (is_textchar(k)) {
+                        append_key(buf, &len, n, k);
                 }
-
-                ++ed.gap_end;
-                update_marks_after_delete(p);
         }
 }
 
-void dedent_current_line()
+/*
+  Incremental search. Every key typed extends the query and jumps to
+  the first match at or after the starting point, or to the last one
+  before it when searching backward. C-s and C-r step through the
+  matches, <cr> stops at the current one and C-g goes back to the
+  start. Any other key stops the search and is handled as usual. The
+  matches are counted while no key is waiting.
+*/
+void isearch(bool backward)
 {
-        guard(!ed.is_read_only);
+        uint8_t *query = ed.search.query;
+        size_t start = ed.gap_start - ed.buffer;
+        size_t start_index = where();
+        bool is_found = false;
 
-        size_t original = new_temp_mark();
+        search_quit();
+        query[0] = 0;
+        ed.search.len = 0;
+        ed.search.kind = SEARCH_LITERAL;
 
-        beginning_of_line();
-        struct tedchar *s = &ed.options.indent.c[0];
-        size_t len = ed.options.indent.len;
-        if (point_matches(s, len))
-                for (size_t i = 0; i < len; ++i)
-                        delete_char();
+        while (1) {
+                size_t n, before;
 
-        move_to(position_of_temp_mark(original));
-        free_temp_mark(original);
-}
+                refresh();
 
-void delete_region()
-{
-        guard(!ed.is_read_only);
+                if (!ed.search.len) {
+                        echo_info("Search: ");
+                } else if (!is_found) {
+                        echo_info("Failing search: %s", query);
+                } else {
+                        echo_info("Search: %s", query);
+                        if (count_matches(&n, &before))
+                                echo_info("Search: %s [%zu/%zu]", query, before + 1, n);
+                }
 
-        size_t low, high;
+                struct key k = read_key();
+                size_t prev = ed.search.len;
 
-        point_mark_low_high(&low, &high);
+                if (key_eq(k, kbd("C-g"))) {
+                        search_quit();
+                        move_to_offset(start);
+                        echo_clear();
+                        return;
+                } else if (key_eq(k, kbd("C-s"))) {
+                        if (is_found)
+                                search_next();
+                        continue;
+                } else if (key_eq(k, kbd("C-r"))) {
+                        if (is_found)
+                                search_previous();
+                        continue;
+                } else if (key_eq(k, kbd("<cr>"))) {
+                        break;
+                } else if (key_eq(k, kbd("<backspace>"))) {
+                        while (ed.search.len && is_continuation_byte(query[--ed.search.len]))
+                                ;
+                        query[ed.search.len] = 0;
+                } else if (is_textchar(k)) {
+                        append_key(query, &ed.search.len, sizeof(ed.search.query), k);
+                } else {
+                        unread_key(k);
+                        break;
+                }
 
-        struct tedchar *p = char_at_index(low);
+                if (ed.search.len == prev)
+                        continue;
 
-        if (!p)
-                return;
+                is_found = false;
+                move_to_offset(start);
 
-        size_t nchars = high - low;
+                if (!ed.search.len)
+                        continue;
 
-        if (nchars == 0)
-                return;
+                size_t s, e;
 
-        move_to(low);
+                if (!first_match(start, backward, &s, &e)) {
+                        search_quit();
+                        echo_error("Out of memory.");
+                        return;
+                }
 
-        while (nchars--)
-                delete_char();
+                if ((is_found = s != SIZE_MAX))
+                        goto_match(s, e);
+        }
+
+        if (!is_found)
+                search_quit();
+
+        echo_clear();
+        if (where() != start_index)
+                do_push_mark(start_index);
 }
 
-void delete_backward_char()
+/*
+  The search program reads the buffer from a sealed memfd that it
+  inherits and opens as /proc/self/fd/N, so nothing touches the disk.
+  Without memfd the buffer goes to a file in /tmp as before, and path
+  is left as that file to unlink afterwards.
+*/
+static int search_input(char *path, size_t n, bool *is_tmp)
 {
-        guard(!ed.is_read_only);
+        int fd = memfd_create("ted-search", MFD_ALLOW_SEALING);
 
-        if (ed.marks.is_active) {
-                delete_region();
-                disable_mark();
-                return;
+        if (fd >= 0) {
+                *is_tmp = false;
+                write_buffer_to_file(fd);
+                fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+                snprintf(path, n, "/proc/self/fd/%d", fd);
+                return fd;
         }
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+        *is_tmp = true;
+        snprintf(path, n, "/tmp/ted-search-XXXXXX");
 
-        ed.is_prefix = false;
+        if ((fd = mkstemp(path)) < 0)
+                return -1;
 
-        while (repeat--) {
-                if (is_buffer_empty() || is_point_at_beginning_of_buffer())
-                        return;
+        write_buffer_to_file(fd);
 
-                backward_char();
-                delete_char();
+        if (close(fd)) {
+                unlink(path);
+                return -1;
         }
+
+        return 0;
 }
 
-void delete_forward_char()
+static void search_external(const char *e)
 {
-        guard(!ed.is_read_only);
+        char cmd[CMD_MAX];
+        char path[32];
+        bool is_tmp;
 
-        if (ed.marks.is_active) {
-                delete_region();
-                disable_mark();
+        int fd = search_input(path, sizeof(path), &is_tmp);
+        if (fd < 0) {
+                echo_error("Failed to start search");
                 return;
         }
 
-        delete_char();
-}
+        snprintf(cmd, CMD_MAX, "%s \'%s\' %zd", e, path, ed.nlines + 1);
 
-static void maybe_insert_trailing_newline()
-{
-        if (!ed.ensure_trailing_newline || is_buffer_empty())
-                return;
+        emit_clear_screen();
+        terminal_reset();
 
-        struct tedchar *p = char_at_index(buffer_size() - 1);
-        if (is_newline(*p))
-                return;
+        FILE *sout;
+        int r = 1;
+        if ((sout = popen(cmd, "r"))) {
+                size_t offset;
 
-        if (is_point_at_end_of_buffer()) {
-                do_insert_char(tedchar_newline());
-        } else {
-                size_t save = index_of(char_at_point());
+                ed.search.last = 0;
+                while (fscanf(sout, "%zu\n", &offset) == 1)
+                        if (!add_search_result(offset_of_file_offset(offset)))
+                                break;
 
-                end_of_buffer();
-                do_insert_char(tedchar_newline());
+                r = pclose(sout);
+        }
 
-                move_to(save);
+        if (is_tmp)
+                unlink(path);
+        else
+                close(fd);
+
+        terminal_setup();
+        reserve_screen();
+        refresh();
+
+        if (r) {
+                echo_info_preserve("Search failed");
+        } else if (!ed.search.last) {
+                echo_info_preserve("No results");
+        } else {
+                ed.search.kind = SEARCH_LIST;
+                do_push_mark(where());
+                goto_search_result(0);
         }
 }
 
-#define for_each_block(buf, sz, i, body)                                 \
-        do {                                                             \
-                struct tedchar *p = first_char();                        \
-                while (p) {                                              \
-                        while (p) {                                      \
-                                if (is_newline(*p)) {                    \
-                                        if (ed.filetype == UNIX) {       \
-                                                if (i >= sz)             \
-                                                        break;           \
-                                                                         \
-                                                buf[i++] = '\n';         \
-                                        } else if (ed.filetype == DOS) { \
-                                                if (i >= sz - 1)         \
-                                                        break;           \
-                                                                         \
-                                                buf[i++] = '\r';         \
-                                                buf[i++] = '\n';         \
-                                        }                                \
-                                } else {                                 \
-                                        size_t k = utf8_count(p->u.c);   \
-                                                                         \
-                                        if (i + k >= sz)                 \
-                                                break;                   \
-                                                                         \
-                                        for (size_t j = 0; j < k; ++j)   \
-                                                buf[i++] = p->u.c[j];    \
-                                }                                        \
-                                p = advance(p);                          \
-                        }                                                \
-                        body;                                            \
-                        i = 0;                                           \
-                }                                                        \
-        } while (0)
-
-int write_all(int fd, uint8_t *buf, size_t n)
+void search_buffer()
 {
-        ssize_t r;
-        int retries = 10;
+        const char *e;
 
-        while (n) {
-                r = write(fd, buf, n);
-                if (r > 0) {
-                        n -= r;
-                } else if (r < 0) {
-                        switch (errno) {
-                        case EINTR:
-                                if (!retries)
-                                        return EINTR;
-                                --retries;
-                                break;
-                        default:
-                                return r;
-                        }
-                } else {
-                        if (!retries)
-                                return EAGAIN;
-                        --retries;
-                }
+        if (ed.search.kind != SEARCH_NONE) {
+                search_next();
+                return;
         }
 
-        return 0;
+        if ((e = getenv("TED_SEARCH")))
+                search_external(e);
+        else
+                isearch(false);
 }
 
-int open_save_file(const char *dirname, const char *basename, char *buf, size_t n)
+void search_buffer_regex()
 {
-        int fd;
-        int flags = O_CREAT | O_TRUNC | O_WRONLY | O_EXCL;
+        uint8_t pattern[QUERY_MAX];
+        struct regex *re;
+        const char *error;
+        size_t start, end;
 
-        for (int i = 0; i < 100; ++i) {
-                snprintf(buf, n, "%s/.%s.%d", dirname, basename, i);
-                if (access(buf, F_OK)) {
-                        fd = open(buf, flags, ed.filemode);
-                        return fd;
-                }
+        if (!read_string("Regexp search: ", pattern, sizeof(pattern)) || !pattern[0])
+                return;
+
+        search_quit();
+
+        if (!(re = malloc(sizeof(*re)))) {
+                echo_error("Out of memory.");
+                return;
         }
 
-        return -1;
-}
+        if (!re_compile(re, pattern, &error)) {
+                free(re);
+                echo_error("%s", error);
+                return;
+        }
 
-bool timespec_lt(struct timespec a, struct timespec b)
-{
-        return a.tv_sec < b.tv_sec || a.tv_nsec < b.tv_nsec;
+        ed.search.kind = SEARCH_REGEX;
+        ed.search.re = re;
+
+        if (!first_match(ed.gap_start - ed.buffer, false, &start, &end)) {
+                search_quit();
+                echo_error("Out of memory.");
+        } else if (start == SIZE_MAX) {
+                search_quit();
+                echo_info_preserve("No results");
+        } else {
+                do_push_mark(where());
+                goto_match(start, end);
+        }
 }
 
-void write_buffer_to_file(int fd)
+/*
+  Replace every occurrence of a string read in the echo area. The
+  occurrences are collected first and then replaced in one pass.
+*/
+void replace_all()
 {
-        uint8_t buf[BUFSIZE] = {0};
-        size_t i = 0;
+        uint8_t from[QUERY_MAX];
+        uint8_t to[QUERY_MAX];
+        struct match *m = NULL;
+        size_t k = 0;
+        size_t capacity = 0;
+        size_t start, end;
 
-        for_each_block(buf, BUFSIZE, i, {
-                if (write_all(fd, buf, i))
-                        return;
-        });
-}
+        guard(!ed.is_read_only);
 
-void save_buffer()
-{
-        maybe_insert_trailing_newline();
+        if (!read_string("Replace: ", from, sizeof(from)) || !from[0])
+                return;
 
-        char pathbuf[PATH_MAX];
+        if (!read_string("Replace with: ", to, sizeof(to)))
+                return;
 
-        int fd = open_save_file(ed.dirname, ed.basename, pathbuf, PATH_MAX);
-        if (fd < 0) {
-                fd = open_save_file(P_tmpdir, ed.basename, pathbuf, PATH_MAX);
-                if (fd < 0) {
-                        echo_error("Failed to save file.");
-                        return;
+        search_quit();
+        ed.search.kind = SEARCH_LITERAL;
+        ed.search.len = strlen((char *)from);
+        memcpy(ed.search.query, from, ed.search.len + 1);
+
+        for (size_t off = 0; find_match(off, SIZE_MAX, &start, &end) && start != SIZE_MAX;
+             off = end) {
+                if (k == capacity) {
+                        capacity = capacity ? capacity * 2 : SEARCH_SIZE;
+                        struct match *p = realloc(m, capacity * sizeof(*m));
+                        if (!p) {
+                                search_quit();
+                                free(m);
+                                echo_error("Out of memory.");
+                                return;
+                        }
+                        m = p;
                 }
+                m[k++] = (struct match){.start = start, .end = end};
         }
 
-        write_buffer_to_file(fd);
+        search_quit();
 
-        if (close(fd)) {
-                echo_error("Failed to save file.");
-                return;
-        }
+        if (!k)
+                echo_info_preserve("No results");
+        else if (!replace_matches(m, k, to, strlen((char *)to)))
+                echo_error("Out of memory.");
+        else
+                echo_info_preserve("Replaced %zu occurrences", k);
 
-        struct stat st;
-        stat(ed.filename, &st);
+        free(m);
+}
 
-        if (timespec_lt(ed.mtime, st.st_mtim)) {
-                echo_error("File has been modified. Wrote to \'%s\'", pathbuf);
+/*
+  Replace occurrences of a string after point one at a time, asking at
+  each. y or <space> replaces, n or <backspace> skips, . replaces and
+  stops, ! replaces the rest without asking, and q, <cr> or C-g stop.
+  Each replacement is made at point, where the match already is, and
+  the marks are carried through them all at once at the end. After !
+  the rest are done in one sweep without redrawing.
+*/
+void query_replace()
+{
+        uint8_t from[QUERY_MAX];
+        uint8_t to[QUERY_MAX];
+        struct match *e = NULL;
+        size_t k = 0;
+        size_t capacity = 0;
+        size_t shift = 0;
+        size_t start_index = where();
+        size_t start, end;
+        bool is_all = false;
+        bool is_last = false;
+
+        guard(!ed.is_read_only);
+
+        if (!read_string("Query replace: ", from, sizeof(from)) || !from[0])
                 return;
-        }
 
-        if (rename(pathbuf, ed.filename)) {
-                echo_error("\'%s\' rename failed.", pathbuf);
+        if (!read_string("Query replace with: ", to, sizeof(to)))
                 return;
-        }
 
-        unlink(pathbuf);
+        size_t n = strlen((char *)to);
+        size_t rc = count_span(to, n);
 
-        echo_info_preserve("Wrote \'%s\'", ed.filename);
-        ed.is_dirty = false;
-        if (!stat(ed.filename, &st))
-                ed.mtime = st.st_mtim;
-}
+        search_quit();
+        disable_mark();
+        ed.search.kind = SEARCH_LITERAL;
+        ed.search.len = strlen((char *)from);
+        memcpy(ed.search.query, from, ed.search.len + 1);
+
+        size_t off = ed.gap_start - ed.buffer;
+
+        while (!is_last && find_match(off, SIZE_MAX, &start, &end) && start != SIZE_MAX) {
+                if (is_all) {
+                        move_point(pointer_at(start));
+                } else {
+                        goto_match(start, end);
+                        refresh();
+                        echo_info("Replace %s? (y, n, !, ., q)", from);
+
+                        struct key key = read_key();
+
+                        if (key_eq(key, kbd("n")) || key_eq(key, kbd("<backspace>"))) {
+                                off = end;
+                                continue;
+                        } else if (key_eq(key, kbd("!"))) {
+                                is_all = true;
+                        } else if (key_eq(key, kbd("."))) {
+                                is_last = true;
+                        } else if (key_eq(key, kbd("q")) || key_eq(key, kbd("<cr>")) ||
+                                   key_eq(key, kbd("C-g"))) {
+                                break;
+                        } else if (!key_eq(key, kbd("y")) && !key_eq(key, kbd("<space>"))) {
+                                unread_key(key);
+                                break;
+                        }
+                }
+
+                if (k == capacity) {
+                        capacity = capacity ? capacity * 2 : SEARCH_SIZE;
+                        struct match *p = realloc(e, capacity * sizeof(*e));
+                        if (!p) {
+                                echo_error("Out of memory.");
+                                break;
+                        }
+                        e = p;
+                }
+
+                size_t i = where() - shift;
+                size_t c;
 
-void do_push_mark(size_t w)
-{
-        ed.marks.m[ed.marks.last] = w;
-        ed.marks.current = ed.marks.last;
-        ed.marks.last = (ed.marks.last + 1) % MARK_RING_SIZE;
+                if (!replace_at_point(end - start, to, n, &c)) {
+                        echo_error("Out of memory.");
+                        break;
+                }
 
-        if (ed.marks.len == MARK_RING_SIZE)
-                ++ed.marks.first;
-        else
-                ++ed.marks.len;
-}
+                e[k++] = (struct match){.start = i, .end = i + c};
+                shift += rc - c;
+                off = ed.gap_start - ed.buffer;
+        }
 
-void exchange_point_and_mark()
-{
-        if (is_buffer_empty())
-                return;
+        search_quit();
 
-        if (!ed.marks.len)
-                return;
+        size_t *at[MARK_RING_SIZE + TEMP_MARKS_SIZE + 1] = {&start_index};
+        remap_indices(at, sort_indices(at, 1), e, k, rc);
+        free(e);
 
-        size_t save = ed.marks.m[ed.marks.current];
-        ed.marks.m[ed.marks.current] = where();
+        shrink_buffer();
+        place_cursor();
+        if (!ed.force_goal_col)
+                ed.goal_col = ed.cursor_col;
 
-        move_to(save);
+        if (!ed.preserve_echo)
+                echo_info_preserve("Replaced %zu occurrences", k);
+        if (where() != start_index)
+                do_push_mark(start_index);
 }
 
-void set_mark()
-{
-        if (ed.is_prefix) {
-                if (!ed.marks.len)
-                        return;
+struct occurrence {
+        size_t line;
+        size_t off;
+};
 
-                exchange_point_and_mark();
+/*
+  The lines with a match for the search, by number and start offset.
+  Lines are stepped through with line_offset, so the whole scan is one
+  pass over the matches and the line table. Returns false if out of
+  memory.
+*/
+static bool find_occurrences(struct occurrence **list, size_t *len)
+{
+        size_t nlines = ed.lines.before + ed.lines.after + 1;
+        size_t capacity = 0;
+        size_t line = 1;
+        size_t from = 0;
+        size_t start, end;
+
+        *list = NULL;
+        *len = 0;
+
+        while (find_match(from, SIZE_MAX, &start, &end)) {
+                if (start == SIZE_MAX)
+                        return true;
+
+                while (line < nlines && line_offset(line + 1) <= start)
+                        ++line;
+
+                if (*len == capacity) {
+                        capacity = capacity ? capacity * 2 : SEARCH_SIZE;
+                        struct occurrence *o = realloc(*list, capacity * sizeof(*o));
+                        if (!o)
+                                return false;
+                        *list = o;
+                }
 
-                if (ed.marks.len <= 1)
-                        return;
+                (*list)[(*len)++] = (struct occurrence){.line = line, .off = line_offset(line)};
 
-                if (ed.marks.current == ed.marks.first)
-                        if (ed.marks.last > 0)
-                                ed.marks.current = ed.marks.last - 1;
-                        else
-                                ed.marks.current = MARK_RING_SIZE - 1;
-                else if (ed.marks.current == 0)
-                        ed.marks.current = MARK_RING_SIZE - 1;
-                else
-                        ed.marks.current -= 1;
-                return;
+                if (line == nlines)
+                        return true;
+                from = line_offset(++line);
         }
 
-        do_push_mark(where());
-        ed.marks.is_active = true;
+        return false;
 }
 
-void set_mark_forward_word()
+/*
+  Draw the occurrences from top on in the screen region, one per row as
+  the line number and as much of the line as fits, with current
+  highlighted.
+*/
+static void draw_occurrences(const struct occurrence o[], size_t len, size_t top, size_t current)
 {
-        set_mark();
-        forward_word();
-}
+        size_t size = text_size();
 
-void set_mark_backward_word()
-{
-        set_mark();
-        backward_word();
-}
+        hide_cursor();
 
-void set_mark_forward_paragraph()
-{
-        set_mark();
-        forward_paragraph();
-}
+        frame_begin();
 
-void set_mark_backward_paragraph()
-{
-        set_mark();
-        backward_paragraph();
-}
+        for (size_t row = 0; row < ed.nlines; ++row) {
+                size_t i = top + row;
 
-void set_mark_next_row()
-{
-        set_mark();
-        next_row();
-}
+                if (i >= len) {
+                        frame_put(EMPTY_LINE, utf8_ascii('~'));
+                        frame_end_row();
+                        continue;
+                }
 
-void set_mark_previous_row()
-{
-        set_mark();
-        previous_row();
-}
+                int style = i == current ? REGION : PLAIN;
+                char num[32];
+                size_t col = 0;
 
-void set_mark_forward_char()
-{
-        set_mark();
-        forward_char();
-}
+                snprintf(num, sizeof(num), "%zu: ", o[i].line);
+                for (; num[col] && col < ed.ncols; ++col)
+                        frame_put(style, utf8_ascii(num[col]));
 
-void set_mark_backward_char()
-{
-        set_mark();
-        backward_char();
+                for (size_t off = o[i].off; off < size && col < ed.ncols; ++col) {
+                        uint8_t *p = pointer_at(off);
+                        struct tedchar t = tedchar_at(p);
+
+                        if (is_newline(t))
+                                break;
+
+                        frame_put(style, is_tab(t) ? utf8_ascii(' ') : t.u);
+                        off += utf8_count(p);
+                }
+
+                frame_end_row();
+        }
+
+        frame_draw();
+
+        goto_((struct position){
+                .y = ed.screen_begin.y + (current - top),
+                .x = ed.screen_begin.x,
+        });
+        show_cursor();
 }
 
-void kill_region_save()
+/*
+  List every line with a match for a regular expression in the screen
+  region. The list is built in one scan of the buffer. C-n and C-p move
+  through it, C-v and M-v by a screenful, <cr> goes to the first match
+  on the line and leaves the search active, and C-g or q leave it.
+*/
+void occur()
 {
-        guard(!ed.is_read_only);
+        uint8_t pattern[QUERY_MAX];
+        struct regex *re;
+        struct occurrence *o;
+        const char *error;
+        size_t len;
+        size_t start, end;
 
-        if (!ed.marks.is_active)
+        if (!read_string("Occur: ", pattern, sizeof(pattern)) || !pattern[0])
                 return;
 
-        ed.kill_size = 0;
+        search_quit();
 
-        size_t low, high;
+        if (!(re = malloc(sizeof(*re)))) {
+                echo_error("Out of memory.");
+                return;
+        }
 
-        point_mark_low_high(&low, &high);
+        if (!re_compile(re, pattern, &error)) {
+                free(re);
+                echo_error("%s", error);
+                return;
+        }
 
-        struct tedchar *t = char_at_index(low);
-        struct tedchar *last = char_at_index(high);
+        ed.search.kind = SEARCH_REGEX;
+        ed.search.re = re;
 
-        while (t && t != last) {
-                ed.kill_buffer[ed.kill_size++] = *t;
-                t = advance(t);
+        if (!find_occurrences(&o, &len)) {
+                free(o);
+                search_quit();
+                echo_error("Out of memory.");
+                return;
         }
 
-        ed.marks.is_active = false;
-}
-
-void kill_region()
-{
-        if (!ed.marks.is_active)
+        if (!len) {
+                search_quit();
+                echo_info_preserve("No results");
                 return;
+        }
 
-        kill_region_save();
+        size_t point_line = line_number();
+        size_t current = 0;
+        size_t top = 0;
 
-        size_t low, high;
+        while (current + 1 < len && o[current].line < point_line)
+                ++current;
 
-        point_mark_low_high(&low, &high);
+        while (1) {
+                if (current < top)
+                        top = current;
+                if (current >= top + ed.nlines)
+                        top = current - ed.nlines + 1;
+
+                draw_occurrences(o, len, top, current);
+                echo_info("Occur: %zu lines", len);
+
+                struct key k = read_key();
+
+                if (key_eq(k, kbd("C-n")) || key_eq(k, kbd("<down>"))) {
+                        if (current + 1 < len)
+                                ++current;
+                } else if (key_eq(k, kbd("C-p")) || key_eq(k, kbd("<up>"))) {
+                        if (current)
+                                --current;
+                } else if (key_eq(k, kbd("C-v")) || key_eq(k, kbd("<next>"))) {
+                        current = min(current + ed.nlines, len - 1);
+                } else if (key_eq(k, kbd("M-v")) || key_eq(k, kbd("<prior>"))) {
+                        current -= min(current, ed.nlines);
+                } else if (key_eq(k, kbd("M-<"))) {
+                        current = 0;
+                } else if (key_eq(k, kbd("M->"))) {
+                        current = len - 1;
+                } else if (key_eq(k, kbd("<cr>"))) {
+                        do_push_mark(where());
+                        if (find_match(o[current].off, SIZE_MAX, &start, &end) && start != SIZE_MAX)
+                                goto_match(start, end);
+                        else
+                                move_to_offset(o[current].off);
+                        break;
+                } else if (key_eq(k, kbd("C-g")) || key_eq(k, kbd("q"))) {
+                        search_quit();
+                        break;
+                }
+        }
 
-        size_t nchars = high - low;
+        free(o);
+        echo_clear();
+}
 
-        move_to(low);
-        while (nchars--)
-                delete_char();
+/*
+  State of the fuzzy line finder. Every byte value has a bit in a
+  64-bit class map, with letters folded, so a line can only match if
+  its map covers the query's. The map of a line is a branch-free table
+  lookup per byte, and only the lines that pass are scored. Each chunk
+  keeps its own best lines, which are merged at the end.
+*/
+struct {
+        uint64_t class[256];
+        uint8_t query[QUERY_MAX];
+        size_t len;
+        uint64_t mask;
+        bool is_folded;
+        size_t n;
+        struct fuzzy_hit {
+                long score;
+                size_t line;
+                size_t off;
+        } hits[MAX_THREADS][MAX_NLINES];
+        size_t nhits[MAX_THREADS];
+} fuzzy;
+
+static void fuzzy_init(const uint8_t *query, size_t len, size_t n)
+{
+        for (size_t b = 0; b < 256; ++b) {
+                if (isalpha(b))
+                        fuzzy.class[b] = 1ull << (tolower(b) - 'a');
+                else if (isdigit(b))
+                        fuzzy.class[b] = 1ull << (26 + b - '0');
+                else if (b > ' ' && b < 0x7f)
+                        fuzzy.class[b] = 1ull << (36 + b % 27);
+                else if (b >= 0x80)
+                        fuzzy.class[b] = 1ull << 63;
+                else
+                        fuzzy.class[b] = 0;
+        }
 
-        ed.marks.is_active = false;
+        fuzzy.is_folded = true;
+        for (size_t i = 0; i < len; ++i)
+                if (isupper(query[i]))
+                        fuzzy.is_folded = false;
+
+        fuzzy.mask = 0;
+        for (size_t i = 0; i < len; ++i) {
+                fuzzy.query[i] = fuzzy.is_folded ? tolower(query[i]) : query[i];
+                fuzzy.mask |= fuzzy.class[query[i]];
+        }
+        fuzzy.len = len;
+        fuzzy.n = n;
 }
 
-void yank()
+static bool fuzzy_eq(uint8_t a, uint8_t q)
 {
-        guard(!ed.is_read_only);
+        return (fuzzy.is_folded ? tolower(a) : a) == q;
+}
 
-        size_t repeat = ed.is_prefix ? ed.prefix_arg : 1;
+/*
+  Score the n bytes of a line, or return -1 if the query is not a
+  subsequence of them. The shortest window holding the query is found
+  by matching forward and then back, and is scored as in fzf: points
+  for each matched byte, more when it follows another match or starts
+  a word, and one off for each byte skipped. The query is matched in
+  lowercase if it has no uppercase letters.
+*/
+static long fuzzy_score(const uint8_t *l, size_t n)
+{
+        const uint8_t *q = fuzzy.query;
+        size_t m = fuzzy.len;
+        size_t i, j;
 
-        ed.is_prefix = false;
+        for (i = 0, j = 0; i < n && j < m; ++i)
+                if (fuzzy_eq(l[i], q[j]))
+                        ++j;
 
-        while (repeat--)
-                for (size_t i = 0; i < ed.kill_size; ++i) {
-                        do_insert_char(ed.kill_buffer[i]);
-                }
-}
+        if (j < m)
+                return -1;
 
-void show_line_column()
-{
-        struct tedchar *p = char_at_point();
-        struct tedchar *t = char_at_index(0);
+        size_t end = i;
+
+        j = m;
+        while (j)
+                if (fuzzy_eq(l[--i], q[j - 1]))
+                        --j;
 
-        size_t line_no = 1;
-        size_t col_no = 1;
+        long score = 0;
+        bool is_prev = false;
 
-        while (t != p) {
-                if (is_newline(*t)) {
-                        ++line_no;
-                        col_no = 1;
+        for (j = 0; i < end; ++i) {
+                if (j < m && fuzzy_eq(l[i], q[j])) {
+                        score += 16;
+                        if (is_prev)
+                                score += 8;
+                        if (!i || !isalnum(l[i - 1]))
+                                score += 8;
+                        is_prev = true;
+                        ++j;
                 } else {
-                        ++col_no;
+                        score -= 1;
+                        is_prev = false;
                 }
-
-                t = advance(t);
         }
 
-        echo_info_preserve("L%uC%u", line_no, col_no);
+        return score;
 }
 
-void toggle_read_only_mode()
+static bool fuzzy_better(struct fuzzy_hit a, struct fuzzy_hit b)
 {
-        ed.is_read_only = !ed.is_read_only;
-        echo_info_preserve("Read-Only mode %s.", ed.is_read_only ? "enabled" : "disabled");
+        return a.score > b.score || (a.score == b.score && a.off < b.off);
 }
 
-void search_previous()
+/* Add h to the best hits of chunk c if it is one of the first fuzzy.n. */
+static void fuzzy_add(size_t c, struct fuzzy_hit h)
 {
-        if (!ed.search.last)
-                return;
+        struct fuzzy_hit *hits = fuzzy.hits[c];
+        size_t i = fuzzy.nhits[c];
 
-        if (ed.search.current == 0) {
-                echo_info_preserve("Wrapped backward search");
-                ed.search.current = ed.search.last - 1;
+        if (i == fuzzy.n) {
+                if (!fuzzy_better(h, hits[i - 1]))
+                        return;
+                --i;
         } else {
-                --ed.search.current;
+                ++fuzzy.nhits[c];
         }
 
-        move_to(ed.search.results[ed.search.current]);
+        for (; i && fuzzy_better(h, hits[i - 1]); --i)
+                hits[i] = hits[i - 1];
+        hits[i] = h;
 }
 
-void search_next()
+/* The first line that starts at or after offset off. */
+static size_t line_at_or_after(size_t off)
 {
-        if (!ed.search.last)
-                return;
+        size_t lo = 1, hi = ed.lines.before + ed.lines.after + 1;
 
-        ++ed.search.current;
-        if (ed.search.current == ed.search.last) {
-                echo_info_preserve("Wrapped search");
-                ed.search.current = 0;
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (line_offset(mid) < off)
+                        lo = mid + 1;
+                else
+                        hi = mid;
         }
 
-        move_to(ed.search.results[ed.search.current]);
+        return lo;
 }
 
-void search_buffer()
+/*
+  Score the lines that start in the chunk. Only the first
+  FUZZY_LINE_MAX bytes of a line are looked at, and a line that
+  straddles the gap is copied out first.
+*/
+static void *fuzzy_chunk(void *arg)
 {
-        char cmd[CMD_MAX];
-        char tmp[] = "/tmp/ted-search-XXXXXX";
-        const char *e;
+        struct chunk *c = arg;
+        size_t nlines = ed.lines.before + ed.lines.after + 1;
+        size_t size = text_size();
+        size_t gap = ed.gap_start - ed.buffer;
+        uint8_t buf[FUZZY_LINE_MAX];
 
-        if (ed.search.last) {
-                search_next();
-                return;
-        }
+        fuzzy.nhits[c->index] = 0;
 
-        int fd = mkstemp(tmp);
-        if (fd < 0) {
-                echo_error("Failed to start search");
-                return;
-        }
+        for (size_t line = line_at_or_after(c->from); line <= nlines; ++line) {
+                size_t off = line_offset(line);
 
-        write_buffer_to_file(fd);
+                if (off >= c->to)
+                        break;
 
-        if (close(fd)) {
-                echo_error("Failed to start search");
-                return;
-        }
+                size_t end = line < nlines ? line_offset(line + 1) - 1 : size;
+                size_t n = min(end - off, FUZZY_LINE_MAX);
+                const uint8_t *l = pointer_at(off);
+                uint64_t mask = 0;
 
-        if ((e = getenv("TED_SEARCH")))
-                snprintf(cmd, CMD_MAX, "%s \'%s\' %zd", e, tmp, ed.nlines + 1);
-        else
-                snprintf(cmd, CMD_MAX,
-                         "printf '\\e[s' > /dev/tty; "
-                         "read -p 'Query: ' query; "
-                         "printf '\\e[u\\e[J' > /dev/tty; "
-                         "grep -bo -F \"$query\" \'%s\' | cut -d: -f1 ",
-                         tmp);
+                if (off < gap && off + n > gap) {
+                        copy_text(buf, off, off + n);
+                        l = buf;
+                }
 
-        emit_clear_screen();
-        terminal_reset();
+                for (size_t i = 0; i < n; ++i)
+                        mask |= fuzzy.class[l[i]];
 
-        FILE *sout;
-        int r = 1;
-        if ((sout = popen(cmd, "r"))) {
-                ed.search.last = 0;
-                while (!feof(sout))
-                        if (fscanf(sout, "%zu\n", &ed.search.results[ed.search.last]) == 1)
-                                ++ed.search.last;
-                        else
-                                break;
+                if ((mask & fuzzy.mask) != fuzzy.mask)
+                        continue;
 
-                r = pclose(sout);
+                long score = fuzzy_score(l, n);
+                if (score >= 0)
+                        fuzzy_add(c->index,
+                                  (struct fuzzy_hit){.score = score, .line = line, .off = off});
         }
 
-        unlink(tmp);
+        return NULL;
+}
 
-        terminal_setup();
-        reserve_screen();
-        refresh();
+/*
+  Put the n best lines for the query in o, best first, and return how
+  many there are.
+*/
+static size_t fuzzy_find(const uint8_t *query, size_t len, struct occurrence o[], size_t n)
+{
+        struct chunk c[MAX_THREADS];
+        struct fuzzy_hit best[MAX_NLINES];
+        size_t nbest = 0;
 
-        if (r) {
-                echo_info_preserve("Search failed");
-        } else if (!ed.search.last) {
-                echo_info_preserve("No results");
-        } else {
-                do_push_mark(where());
-                move_to(ed.search.results[ed.search.current = 0]);
+        fuzzy_init(query, len, n);
+
+        size_t k = run_chunks(fuzzy_chunk, c, 0, text_size());
+
+        for (size_t i = 0; i < k; ++i) {
+                for (size_t j = 0; j < fuzzy.nhits[i]; ++j) {
+                        struct fuzzy_hit h = fuzzy.hits[i][j];
+                        size_t x = nbest < n ? nbest++ : n;
+
+                        if (x == n && !fuzzy_better(h, best[--x]))
+                                continue;
+
+                        for (; x && fuzzy_better(h, best[x - 1]); --x)
+                                best[x] = best[x - 1];
+                        best[x] = h;
+                }
         }
+
+        for (size_t i = 0; i < nbest; ++i)
+                o[i] = (struct occurrence){.line = best[i].line, .off = best[i].off};
+
+        return nbest;
 }
 
-void search_quit()
+/*
+  Pick a line by fuzzy matching. The best lines for what has been
+  typed so far are listed in the screen region, and are found again
+  whenever the query changes and no more keys are waiting. C-n and C-p
+  move through them, <cr> goes to the chosen line and C-g leaves.
+*/
+void find_line()
 {
-        ed.search.last = 0;
+        uint8_t query[QUERY_MAX];
+        size_t len = 0;
+        struct occurrence o[MAX_NLINES];
+        size_t n = 0;
+        size_t current = 0;
+        bool is_stale = true;
+
+        query[0] = 0;
+
+        while (1) {
+                if (is_stale && !key_pending()) {
+                        if (len) {
+                                n = fuzzy_find(query, len, o, ed.nlines);
+                        } else {
+                                size_t nlines = ed.lines.before + ed.lines.after + 1;
+                                for (n = 0; n < ed.nlines && line_number() + n <= nlines; ++n)
+                                        o[n] = (struct occurrence){
+                                                .line = line_number() + n,
+                                                .off = line_offset(line_number() + n),
+                                        };
+                        }
+                        current = 0;
+                        is_stale = false;
+                }
+
+                draw_occurrences(o, n, 0, current);
+                echo_info("Find line: %s", query);
+
+                struct key k = read_key();
+
+                if (key_eq(k, kbd("C-g"))) {
+                        break;
+                } else if (key_eq(k, kbd("<cr>"))) {
+                        if (n) {
+                                do_push_mark(where());
+                                move_to_offset(o[current].off);
+                        }
+                        break;
+                } else if (key_eq(k, kbd("C-n")) || key_eq(k, kbd("<down>"))) {
+                        if (current + 1 < n)
+                                ++current;
+                } else if (key_eq(k, kbd("C-p")) || key_eq(k, kbd("<up>"))) {
+                        if (current)
+                                --current;
+                } else if (key_eq(k, kbd("<backspace>"))) {
+                        while (len && is_continuation_byte(query[--len]))
+                                ;
+                        query[len] = 0;
+                        is_stale = true;
+                } else if (is_textchar(k)) {
+                        append_key(query, &len, sizeof(query), k);
+                        is_stale = true;
+                }
+        }
+
+        echo_clear();
 }
 
 void quit()
@@ -2780,6 +6607,13 @@ exit_success:
         free(ed.filename);
         free(ed.dirname);
         free(ed.basename);
+        free(ed.buffer);
+        free(ed.lines.nl);
+        free(ed.checkpoints.c);
+        free(ed.rows.r);
+        free(ed.kill_buffer);
+        search_quit();
+        free(ed.search.results);
         exit(0);
 }
 
@@ -2825,7 +6659,9 @@ const struct keymap_entry extended_keymap[] = {
         {"=", CMD(show_line_column)},  {"C-c", CMD(quit)},
         {"C-n", CMD(set_goal_column)}, {"C-q", CMD(toggle_read_only_mode)},
         {"C-s", CMD(save_buffer)},     {"C-x", CMD(exchange_point_and_mark)},
-        {"M-c", CMD(kill_ted)},        {0, CMD(cancel)},
+        {"M-c", CMD(kill_ted)},        {"f", CMD(find_line)},
+        {"o", CMD(occur)},             {"r", CMD(replace_all)},
+        {0, CMD(cancel)},
 };
 
 const struct keymap_entry global_keymap[] = {
@@ -2860,6 +6696,7 @@ const struct keymap_entry global_keymap[] = {
         {"M-g", CMD(goto_line)},
         {"M-j", CMD(indent_current_line)},
         {"M-o", CMD(open_next_line)},
+        {"M-r", CMD(query_replace)},
         {"M-v", CMD(scroll_down)},
         {"M-w", CMD(kill_region_save)},
         {"M-%", CMD(goto_percent)},
@@ -2871,6 +6708,7 @@ const struct keymap_entry global_keymap[] = {
         {"S-<up>", CMD(set_mark_previous_row)},
         {"C-M-b", CMD(backward_paragraph)},
         {"C-M-f", CMD(forward_paragraph)},
+        {"C-M-s", CMD(search_buffer_regex)},
         {"C-S-<down>", CMD(set_mark_forward_paragraph)},
         {"C-S-<left>", CMD(set_mark_backward_word)},
         {"C-S-<right>", CMD(set_mark_forward_word)},
@@ -2988,6 +6826,7 @@ static void print_usage_and_exit()
         fprintf(stderr, "  -g last\tStart with point at the end.\n");
         fprintf(stderr, "  -g NUM\tStart with point at the NUMth character.\n");
         fprintf(stderr, "  -i INDENT\tUse INDENT as one unit of indent.\n");
+        fprintf(stderr, "  -j THREADS\tSearch with up to THREADS threads.\n");
         fprintf(stderr, "  -r ROWS\tShow ROWS lines at a time.\n");
         fprintf(stderr, "  -t TABS\tUse TABS columns for each tabstop.\n");
         exit(EXIT_FAILURE);
@@ -3010,15 +6849,17 @@ void editor_config_init(int argc, char *argv[])
 {
         int c;
         char *endptr;
-        long rows, cols, tabs;
+        long rows, cols, tabs, threads;
 
         ed.nlines = DEFAULT_NLINES;
         ed.ncols = DEFAULT_NCOLS;
         ed.tabstop = DEFAULT_TABSTOP;
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        ed.nthreads = threads < MIN_THREADS ? MIN_THREADS : min(threads, MAX_THREADS);
         ed.filetype = DEFAULT_FILETYPE;
         set_indent(DEFAULT_INDENT);
         ed.options.position.k = FIRST;
-        while ((c = getopt(argc, argv, "r:c:t:f:g:i:")) != -1) {
+        while ((c = getopt(argc, argv, "r:c:t:f:g:i:j:")) != -1) {
                 switch (c) {
                 case 'r':
                         if (!*optarg)
@@ -3080,6 +6921,17 @@ void editor_config_init(int argc, char *argv[])
                         if (!*optarg)
                                 print_usage_and_exit();
                         set_indent((uint8_t *)optarg);
+                        break;
+                case 'j':
+                        if (!*optarg)
+                                print_usage_and_exit();
+                        threads = strtol(optarg, &endptr, 10);
+                        if (*endptr)
+                                print_usage_and_exit();
+                        if (threads < MIN_THREADS || threads > MAX_THREADS)
+                                print_usage_and_exit();
+                        ed.nthreads = threads;
+                        break;
                 }
         }
 }
@@ -3102,7 +6954,20 @@ int main(int argc, char *argv[])
 
         reserve_screen();
 
-        refresh();
+        /*
+          Show the start of the file while the rest is decoded, unless the
+          first screen is somewhere else.
+        */
+        if (ed.options.position.k == FIRST) {
+                refresh();
+                output_flush();
+        }
+
+        if (!finish_loading()) {
+                emit_clear_screen();
+                terminal_reset();
+                err_exit(loading.error);
+        }
 
         switch (ed.options.position.k) {
         case FIRST: